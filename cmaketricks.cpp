@@ -1,13 +1,10 @@
-#include <cassert>
 #include <cstdio>
-#include <cstring>
-#include <regex>
-#include <windows.h>
+#include <cstdlib>
 #include <algorithm>
+#include "cmaketricks.h"
 
 #pragma comment(linker, "/SUBSYSTEM:CONSOLE")
 
-#define CP_UNIXCP 65010  /* Wine extension */
 static const auto g_Usage =
     "usage: cmaketricks [option(s)] [file(s)]\n"
     " Utility to remaps CL's Command Files and precompiled headers, as those are not known by the scripts.\n"
@@ -27,21 +24,47 @@ static const auto g_Usage =
     "  2       Failed to get address of wine-internal function, did you run the executable under wine?\n"
     "  3       Failed to open file to remap\n"
     "  4       Failed to remap path, wine-internal failure\n";
-static const std::regex JUS_PATH{ "\\/.+\\/.+" };                // /absolute/path
-static const std::regex ONE_PATH{ "[-\\/][A-Za-z]\\/.*" };       // -I/absolute/path /I/absolute/path
-static const std::regex DUO_PATH{ "[-\\/][A-Za-z]{2}\\/.*" };    // -Fo/absolute/path /Fo/absolute/path
-static const std::regex TRI_PATH{ "[-\\/][A-Za-z]{3,}:\\/.*" };  // -MANIFESTINPUT:/absolute/path /MANIFESTINPUT:/absolute/path
-using GetFilename_t = LPWSTR (*__cdecl)( LPCSTR );
-static GetFilename_t g_WineGetDosFilename{ nullptr };
-static bool g_Quiet{ false };
-static bool g_Debug{ false };
-enum class Mode { PCH, CMD };
 
 
-void remapFile( const char *pFile, Mode pMode );
-void remap( char* pPath, int pLen );
-const char* token( const char* pBuffer, char* pToken, int pTokenLen );
+// Microseconds since the Unix epoch, the clock of EPOCHREALTIME in the
+// wrappers.
+static unsigned long long traceNow() {
+  FILETIME ft;
+  GetSystemTimePreciseAsFileTime( &ft );
+  const auto time = (static_cast<unsigned long long>( ft.dwHighDateTime ) << 32) | ft.dwLowDateTime;
+  return (time - 116444736000000000ull) / 10;
+}
 
+// Appends the span of remapping a file to the WINE_MSVC_TRACE file (see
+// wine-msvc.sh), under the pid of the wrapper, WINE_MSVC_TRACE_PID.
+static void traceRemap( const std::string& pTrace, const char* pFile, unsigned long long pStart ) {
+  std::string pid;
+  if ( const char* env = getenv( "WINE_MSVC_TRACE_PID" ) )
+    pid = env;
+  if ( pid.empty() || pid.find_first_not_of( "0123456789" ) != std::string::npos )
+    pid = std::to_string( GetCurrentProcessId() );
+
+  const char* name = pFile;
+  for ( const char* c = pFile; *c; c += 1 )
+    if ( *c == '/' || *c == '\\' )
+      name = c + 1;
+  std::string line = "{\"name\":\"remap ";
+  for ( const char* c = name; *c; c += 1 ) {
+    if ( *c == '"' || *c == '\\' )
+      line += '\\';
+    line += *c;
+  }
+  line += "\",\"cat\":\"cmaketricks\",\"ph\":\"X\",\"ts\":" + std::to_string( pStart )
+        + ",\"dur\":" + std::to_string( traceNow() - pStart ) + ",\"pid\":" + pid + ",\"tid\":" + pid + "}\n";
+
+  // a single write keeps the lines of concurrent writers apart
+  const auto handle = CreateFileA( pTrace.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+  if ( handle != INVALID_HANDLE_VALUE ) {
+    DWORD written;
+    WriteFile( handle, line.data(), static_cast<DWORD>( line.size() ), &written, nullptr );
+    CloseHandle( handle );
+  }
+}
 
 int main( int argc, char **argv ) {
   if ( argc == 1 ) {
@@ -57,163 +80,44 @@ int main( int argc, char **argv ) {
     puts( g_Usage );
     return 0;
   }
-  if ( hasArgument( "--quiet" ) || hasArgument( "-q" ) ) {
-    g_Quiet = true;
-  }
-  if ( hasArgument( "--debug" ) ) {
-    g_Debug = true;
-  }
-  Mode mode = hasArgument( "--pch" ) ? Mode::PCH : Mode::CMD;
+  const bool quiet = hasArgument( "--quiet" ) || hasArgument( "-q" );
+  const auto mode = hasArgument( "--pch" ) ? Remapper::Mode::PCH : Remapper::Mode::CMD;
 
   // load wine func
-  g_WineGetDosFilename = reinterpret_cast<GetFilename_t>( GetProcAddress( GetModuleHandleA( "KERNEL32" ), "wine_get_dos_file_name" ) );
-  if ( g_WineGetDosFilename == nullptr ) {
-    if (! g_Quiet )
+  Remapper remapper{ hasArgument( "--debug" ) };
+  if (! remapper.valid() ) {
+    if (! quiet )
       fputs( "cmdfileremap: cannot get the address of 'wine_get_dos_file_name'\n", stderr );
     exit( 2 );
   }
 
-  // process files
+  // the trace file is a unix path, unless it is relative
+  std::string trace;
+  if ( const char* path = getenv( "WINE_MSVC_TRACE" ) ) {
+    if ( path[0] == '/' ) {
+      if ( const auto* dos = remapper.dosPath( path, strlen( path ) ) )
+        trace = *dos;
+    } else {
+      trace = path;
+    }
+  }
+
+  // process files, all of them share the remapped paths
   for ( int i = 1; i < argc; i += 1 ) {
     // skip (unknown) arguments
     if ( argv[i][0] == '-' )
       continue;
 
-    remapFile( argv[i], mode );
-  }
-
-  return 0;
-}
-
-void remapFile( const char *pFile, Mode pMode ) { // NOLINT(*-no-recursion)
-  // open file for reading
-  auto file = fopen( pFile, "r" );
-  if ( file == nullptr ) {
-    if (! g_Quiet )
-      fprintf( stdout, "Failed to remap response file `%s`: %s", pFile, strerror( errno ) );
-    exit( 3 );
-  }
-
-  // find file size
-  fseek( file, 0, SEEK_END );
-  const auto size = ftell( file );
-  fseek( file, 0, SEEK_SET );
-
-  // read the entire file
-  const auto buffer = new char[size + 1];
-  const auto bufLen = fread( buffer, 1, size, file );
-  assert( size == bufLen );
-  buffer[size] = '\0';
-  // close the file for reading
-  fclose( file );
-
-  // open file for writing
-  if (! g_Debug )
-    file = fopen( pFile, "w" );
-  else
-    file = fopen( (std::string{pFile} + ".out").c_str(), "w" );
-  if ( file == nullptr ) {
-    if (! g_Quiet )
-      fprintf( stdout, "Failed to remap response file `%s`: %s", pFile, strerror( errno ) );
-    exit( 3 );
-  }
-  // process file
-  static constexpr auto TOKEN_SIZE{ 1024 };
-  auto* tok = new char[TOKEN_SIZE];
-  const char* ptr{ buffer };
-  while ( (ptr = token( ptr, tok, TOKEN_SIZE )) ) {
-    if ( tok[0] == ' ' ) // empty string
-      continue;
-    if ( *tok == '\r' || *tok == '\n' ) { // newline
-      fputc( *tok, file );
-      continue;
-    }
-
-    if ( g_Debug )
-      printf( "Token: `%s` -> ", tok );
-    if ( pMode == Mode::CMD ) {
-      if ( std::regex_match( tok, ONE_PATH ) ) {
-        remap( tok + 2, TOKEN_SIZE );
-        fprintf( file, "\"%s\" ", tok );
-      } else if ( std::regex_match( tok, DUO_PATH ) ) {
-        remap( tok + 3, TOKEN_SIZE );
-        fprintf( file, "\"%s\" ", tok );
-        // Forced includes and preprocessed files need extra remapping
-        if ( tok[1] == 'F' && (tok[2] == 'I' || tok[2] == 'i') ) {
-          remapFile( tok + 3, Mode::PCH );
-        }
-      } else if ( std::regex_match( tok, TRI_PATH ) ) {
-        // the path is after the colon
-        remap( strchr( tok, ':' ) + 1, TOKEN_SIZE );
-        fprintf( file, "\"%s\" ", tok );
-      } else if ( std::regex_match( tok, JUS_PATH ) ) {
-        remap( tok, TOKEN_SIZE );
-        fprintf( file, "\"%s\" ", tok );
-      } else {
-        fprintf( file, "\"%s\" ", tok );
-      }
-    } else if ( pMode == Mode::PCH ) {
-      if ( strcmp( tok, "#include" ) == 0 ) {
-        // if it is an include, gotta remap!
-        fputs( tok, file );
-        ptr = token( ptr, tok, TOKEN_SIZE );
-        remap( tok, TOKEN_SIZE );
-        fprintf( file, " \"%s\"", tok );
-      } else {
-        // nothing special, just echo it out
-        fprintf( file, "%s ", tok );
-      }
+    const auto start = traceNow();
+    const auto ret = remapper.remapFile( argv[i], mode );
+    if (! trace.empty() )
+      traceRemap( trace, argv[i], start );
+    if ( ret != Remapper::OK ) {
+      if (! quiet )
+        fprintf( stderr, "%s\n", remapper.error().c_str() );
+      exit( ret );
     }
-    if ( g_Debug )
-     printf( "`%s`\n", tok );
-  }
-  // flush and close
-  fflush( file );
-  fclose( file );
-}
-
-void remap( char* pPath, int pLen ) {
-  auto winPath = g_WineGetDosFilename( pPath );
-  if (! winPath ) {
-    if (! g_Quiet )
-      fprintf( stderr, "failed to remap path `%s`", pPath );
-    exit( 4 );
   }
 
-  WideCharToMultiByte( CP_UNIXCP, 0, winPath, -1, pPath, pLen, nullptr, nullptr );
-  HeapFree( GetProcessHeap(), 0, winPath );
-}
-
-const char* token( const char* pBuffer, char* pToken, int pTokenLen ) {
-  while ( (*pBuffer == ' ' || *pBuffer == '\t') && *pBuffer != '\0' )
-    pBuffer += 1;
-
-  if ( *pBuffer == '\r' || *pBuffer == '\n' ) {
-    pToken[0] = *pBuffer;
-    pToken[1] = '\0';
-    return pBuffer + 1;
-  }
-
-  if ( *pBuffer == '\0' )
-    return nullptr;
-
-  int offset = 0;
-  const char* start;
-  if ( *pBuffer == '"' ) {  // parse a quoted string
-    start = (pBuffer += 1);
-    while ( *pBuffer != '"' && *pBuffer != '\0' )
-      pBuffer += 1;
-  } else {  // parse a single token
-    start = pBuffer;
-    while ( *pBuffer != ' ' && *pBuffer != '\t' && *pBuffer != '\0' && *pBuffer != '\r' && *pBuffer != '\n' )
-      pBuffer += 1;
-  }
-
-  // copy the token
-  auto size = pBuffer - start;
-  assert( size < pTokenLen - 1 );
-  memcpy( pToken, start, size );
-  pToken[ size ] = '\0';
-  // return the new initial position
-  return pBuffer + offset;
+  return 0;
 }
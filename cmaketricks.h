@@ -0,0 +1,423 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <windows.h>
+
+#ifndef CP_UNIXCP
+#define CP_UNIXCP 65010  /* Wine extension */
+#endif
+
+// What kind of path argument a command file token is, as in where the path
+// that needs remapping starts. This is equivalent to matching the token
+// against the following regular expressions, in this order:
+//   ONE  [-/][A-Za-z]/.*        -I/absolute/path /I/absolute/path
+//   DUO  [-/][A-Za-z]{2}/.*     -Fo/absolute/path /Fo/absolute/path
+//   TRI  [-/][A-Za-z]{3,}:/.*   -MANIFESTINPUT:/absolute/path /MANIFESTINPUT:/absolute/path
+//   JUS  /.+/.+                 /absolute/path
+// but done in a single pass over the token, without any allocations.
+enum class PathKind { NONE, ONE, DUO, TRI, JUS };
+
+namespace details {
+  enum : unsigned char { ALPHA = 1, EOL = 2 };
+
+  struct CharTable {
+    unsigned char flags[256]{};
+
+    constexpr CharTable() {
+      for ( int c = 'A'; c <= 'Z'; c += 1 )
+        flags[c] |= ALPHA;
+      for ( int c = 'a'; c <= 'z'; c += 1 )
+        flags[c] |= ALPHA;
+      // `.` doesn't match line terminators
+      flags['\r'] |= EOL;
+      flags['\n'] |= EOL;
+    }
+  };
+
+  constexpr CharTable g_CharTable{};
+}
+
+// The token doesn't need to be NUL-terminated, so it can be a view into the
+// command file.
+inline PathKind classify( const char* pToken, size_t pLen ) {
+  const auto* tok = reinterpret_cast<const unsigned char*>( pToken );
+  const auto& flags = details::g_CharTable.flags;
+
+  if ( pLen == 0 || (tok[0] != '-' && tok[0] != '/') )
+    return PathKind::NONE;
+
+  // the run of letters after the switch character
+  size_t letters = 0;
+  while ( 1 + letters < pLen && flags[ tok[1 + letters] ] & details::ALPHA )
+    letters += 1;
+  const int next = 1 + letters < pLen ? tok[1 + letters] : '\0';
+
+  // check the rest of the token for line terminators, and for a slash that
+  // isn't one of the first two characters, and that is followed by something
+  bool innerSlash = false;
+  for ( size_t i = 1; i < pLen; i += 1 ) {
+    if ( flags[ tok[i] ] & details::EOL )
+      return PathKind::NONE;
+    if ( i >= 2 && tok[i] == '/' && i + 1 < pLen )
+      innerSlash = true;
+  }
+
+  if ( letters == 1 && next == '/' )
+    return PathKind::ONE;
+  if ( letters == 2 && next == '/' )
+    return PathKind::DUO;
+  if ( letters >= 3 && next == ':' && 2 + letters < pLen && tok[2 + letters] == '/' )
+    return PathKind::TRI;
+  if ( tok[0] == '/' && innerSlash )
+    return PathKind::JUS;
+  return PathKind::NONE;
+}
+
+inline PathKind classify( const char* pToken ) {
+  return classify( pToken, strlen( pToken ) );
+}
+
+
+// A token of a command file, pointing into the loaded file
+struct Token {
+  const char* data;
+  size_t size;
+};
+
+// The buffer ends at `pEnd`, or at a NUL if that is null, so that it can be a
+// mapped file.
+inline const char* token( const char* pBuffer, Token& pToken, const char* pEnd = nullptr ) {
+  const auto more = [pEnd]( const char* p ) { return p != pEnd && *p != '\0'; };
+  while ( more( pBuffer ) && (*pBuffer == ' ' || *pBuffer == '\t') )
+    pBuffer += 1;
+
+  if (! more( pBuffer ) )
+    return nullptr;
+
+  if ( *pBuffer == '\r' || *pBuffer == '\n' ) {
+    pToken = { pBuffer, 1 };
+    return pBuffer + 1;
+  }
+
+  int offset = 0;
+  const char* start;
+  if ( *pBuffer == '"' ) {  // parse a quoted string
+    start = (pBuffer += 1);
+    while ( more( pBuffer ) && *pBuffer != '"' )
+      pBuffer += 1;
+    // skip the closing quote
+    if ( more( pBuffer ) )
+      offset = 1;
+  } else {  // parse a single token
+    start = pBuffer;
+    while ( more( pBuffer ) && *pBuffer != ' ' && *pBuffer != '\t' && *pBuffer != '\r' && *pBuffer != '\n' )
+      pBuffer += 1;
+  }
+
+  pToken = { start, static_cast<size_t>( pBuffer - start ) };
+  // return the new initial position
+  return pBuffer + offset;
+}
+
+// Rewrites the unix paths in command files (and the headers they force
+// include) into DOS paths, in place. This is all of cmaketricks, and it is
+// also used by msvctricks to remap the command files of a tool invocation
+// right in the process that starts the tool. Failures are reported with the
+// exit codes of cmaketricks, and a description in `error()`.
+class Remapper {
+public:
+  enum class Mode { PCH, CMD };
+  enum : int { OK = 0, NO_WINE = 2, OPEN_FAILED = 3, REMAP_FAILED = 4 };
+
+  explicit Remapper( bool pDebug = false ) : m_Debug( pDebug ) {
+    m_WineGetDosFilename = reinterpret_cast<GetFilename_t>( GetProcAddress( GetModuleHandleA( "KERNEL32" ), "wine_get_dos_file_name" ) );
+    if ( m_WineGetDosFilename == nullptr )
+      m_Error = "cannot get the address of 'wine_get_dos_file_name'";
+  }
+
+  bool valid() const { return m_WineGetDosFilename != nullptr; }
+  const std::string& error() const { return m_Error; }
+
+  int remapFile( const char* pFile, Mode pMode ) { // NOLINT(*-no-recursion)
+    if (! valid() )
+      return NO_WINE;
+
+    // map the entire file
+    MappedFile in;
+    if (! in.open( pFile ) )
+      return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( GetLastError() ).c_str() );
+
+    // process file, tokens point into the mapping and the whole output is
+    // assembled in memory, to be written out in one go
+    std::string out;
+    out.reserve( in.size + in.size / 2 );
+    Token tok;
+    const char* ptr{ in.data };
+    const char* const end{ in.data + in.size };
+    while ( (ptr = token( ptr, tok, end )) ) {
+      if ( tok.size > 0 && tok.data[0] == ' ' ) // empty string
+        continue;
+      if ( tok.size > 0 && (tok.data[0] == '\r' || tok.data[0] == '\n') ) { // newline
+        out += tok.data[0];
+        continue;
+      }
+
+      if ( m_Debug )
+        printf( "Token: `%.*s` -> ", static_cast<int>( tok.size ), tok.data );
+      const auto begin = out.size();
+      if ( pMode == Mode::CMD ) {
+        out += '"';
+        switch ( classify( tok.data, tok.size ) ) {
+          case PathKind::ONE:
+            out.append( tok.data, 2 );
+            if (! remap( out, tok.data + 2, tok.size - 2 ) )
+              return REMAP_FAILED;
+            break;
+          case PathKind::DUO: {
+            out.append( tok.data, 3 );
+            const auto path = out.size();
+            if (! remap( out, tok.data + 3, tok.size - 3 ) )
+              return REMAP_FAILED;
+            // Forced includes and preprocessed files need extra remapping
+            if ( tok.data[1] == 'F' && (tok.data[2] == 'I' || tok.data[2] == 'i') ) {
+              const auto ret = remapFile( out.substr( path ).c_str(), Mode::PCH );
+              if ( ret != OK )
+                return ret;
+            }
+            break;
+          }
+          case PathKind::TRI: {
+            // the path is after the colon
+            const auto prefix = static_cast<const char*>( memchr( tok.data, ':', tok.size ) ) + 1 - tok.data;
+            out.append( tok.data, prefix );
+            if (! remap( out, tok.data + prefix, tok.size - prefix ) )
+              return REMAP_FAILED;
+            break;
+          }
+          case PathKind::JUS:
+            if (! remap( out, tok.data, tok.size ) )
+              return REMAP_FAILED;
+            break;
+          case PathKind::NONE:
+            out.append( tok.data, tok.size );
+            break;
+        }
+        out += "\" ";
+      } else if ( pMode == Mode::PCH ) {
+        if ( tok.size == 8 && memcmp( tok.data, "#include", 8 ) == 0 ) {
+          // if it is an include, gotta remap!
+          out.append( tok.data, tok.size );
+          if (! (ptr = token( ptr, tok, end )) )
+            break;
+          if ( tok.size > 0 && tok.data[0] == '<' ) {
+            // system headers are found through INCLUDE
+            out += ' ';
+            out.append( tok.data, tok.size );
+          } else if ( tok.size > 1 && tok.data[1] == ':' ) {
+            // remapped already, by a compile that used the header before
+            out += " \"";
+            out.append( tok.data, tok.size );
+            out += '"';
+          } else {
+            out += " \"";
+            if (! remap( out, tok.data, tok.size ) )
+              return REMAP_FAILED;
+            out += '"';
+          }
+        } else {
+          // nothing special, just echo it out
+          out.append( tok.data, tok.size );
+          out += ' ';
+        }
+      }
+      if ( m_Debug )
+        printf( "`%s`\n", out.c_str() + begin );
+    }
+
+    // nothing to do if nothing changed, like when the file was remapped
+    // already, and the mapping has to go before the file can be replaced
+    const bool unchanged = out.size() == in.size && memcmp( out.data(), in.data, in.size ) == 0;
+    BY_HANDLE_FILE_INFORMATION info{};
+    const bool hardlinked = GetFileInformationByHandle( in.file, &info ) && info.nNumberOfLinks > 1;
+    in.close();
+    if ( unchanged && !m_Debug )
+      return OK;
+
+    // replacing a symlink or a file with other hardlinks would leave the file
+    // they share as it is, so those are rewritten in place
+    const auto attributes = GetFileAttributesA( pFile );
+    const bool symlink = attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+    if ( (hardlinked || symlink) && !m_Debug ) {
+      const auto handle = CreateFileA( pFile, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+      if ( handle == INVALID_HANDLE_VALUE )
+        return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( GetLastError() ).c_str() );
+      const bool written = writeAll( handle, out ) && SetEndOfFile( handle );
+      const auto error = GetLastError();
+      CloseHandle( handle );
+      if (! written )
+        return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( error ).c_str() );
+      return OK;
+    }
+
+    // write into a temporary file next to it, which then replaces it, so
+    // that concurrent readers see either the old or the new contents
+    const auto outFile = m_Debug ? std::string{ pFile } + ".out" : std::string{ pFile };
+    static volatile LONG counter = 0;
+    const auto tmpFile = outFile + ".tmp" + std::to_string( GetCurrentProcessId() ) + "." + std::to_string( InterlockedIncrement( &counter ) );
+    const auto handle = CreateFileA( tmpFile.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( handle == INVALID_HANDLE_VALUE )
+      return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( GetLastError() ).c_str() );
+    // write and close
+    if (! writeAll( handle, out ) ) {
+      const auto error = GetLastError();
+      CloseHandle( handle );
+      DeleteFileA( tmpFile.c_str() );
+      return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( error ).c_str() );
+    }
+    CloseHandle( handle );
+    // another compile may still have the file mapped for a moment
+    bool moved = false;
+    for ( int i = 0; i < 100 && !moved; i += 1 ) {
+      moved = MoveFileExA( tmpFile.c_str(), outFile.c_str(), MOVEFILE_REPLACE_EXISTING );
+      if (! moved )
+        Sleep( 10 );
+    }
+    if (! moved ) {
+      const auto error = GetLastError();
+      DeleteFileA( tmpFile.c_str() );
+      return fail( OPEN_FAILED, "Failed to remap response file `", pFile, "`: error ", std::to_string( error ).c_str() );
+    }
+    return OK;
+  }
+
+  // Appends the DOS path of the given unix path to `pOut`
+  bool remap( std::string& pOut, const char* pPath, size_t pLen ) {
+    // The DOS path of a file is the DOS path of its directory plus its name, as
+    // long as the name doesn't contain anything that wine would need to mangle.
+    const char* end = pPath + pLen;
+    const char* name = end;
+    while ( name != pPath && name[-1] != '/' )
+      name -= 1;
+    bool splittable = pLen > 0 && pPath[0] == '/' && name != end;
+    for ( const char* c = name; splittable && c != end; c += 1 )
+      splittable = strchr( "\\:*?\"<>|", *c ) == nullptr;
+
+    if ( splittable ) {
+      // `name` is just past the last slash
+      const auto dir = name - 1 == pPath ? 1 : name - 1 - pPath;
+      const auto* winDir = dosPath( pPath, dir );
+      if (! winDir )
+        return false;
+      pOut += *winDir;
+      if ( winDir->empty() || winDir->back() != '\\' )
+        pOut += '\\';
+      pOut.append( name, end - name );
+    } else {
+      const auto* winPath = dosPath( pPath, pLen );
+      if (! winPath )
+        return false;
+      pOut += *winPath;
+    }
+    return true;
+  }
+
+  // The (cached) DOS path of the given unix path, or null if it can't be remapped
+  const std::string* dosPath( const char* pPath, size_t pLen ) {
+    m_Key.assign( pPath, pLen );
+    auto it = m_Cache.find( m_Key );
+    if ( it != m_Cache.end() )
+      return &it->second;
+
+    auto winPath = m_WineGetDosFilename( m_Key.c_str() );
+    if (! winPath ) {
+      fail( REMAP_FAILED, "failed to remap path `", m_Key.c_str(), "`" );
+      return nullptr;
+    }
+
+    const auto len = WideCharToMultiByte( CP_UNIXCP, 0, winPath, -1, nullptr, 0, nullptr, nullptr );
+    std::string result( len > 0 ? len : 1, '\0' );
+    WideCharToMultiByte( CP_UNIXCP, 0, winPath, -1, &result[0], len, nullptr, nullptr );
+    result.pop_back();
+    HeapFree( GetProcessHeap(), 0, winPath );
+
+    return &m_Cache.emplace( m_Key, std::move( result ) ).first->second;
+  }
+
+private:
+  using GetFilename_t = LPWSTR (*__cdecl)( LPCSTR );
+
+  // A read-only view of a whole file. Empty files can't be mapped, but
+  // don't need to be.
+  struct MappedFile {
+    HANDLE file{ INVALID_HANDLE_VALUE };
+    HANDLE mapping{ nullptr };
+    const char* data{ "" };
+    size_t size{ 0 };
+
+    bool open( const char* pFile ) {
+      file = CreateFileA( pFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+      if ( file == INVALID_HANDLE_VALUE )
+        return false;
+      LARGE_INTEGER fileSize;
+      if (! GetFileSizeEx( file, &fileSize ) )
+        return false;
+      if ( fileSize.QuadPart == 0 )
+        return true;
+      mapping = CreateFileMappingW( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+      if ( mapping == nullptr )
+        return false;
+      const auto* view = static_cast<const char*>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+      if ( view == nullptr )
+        return false;
+      data = view;
+      size = static_cast<size_t>( fileSize.QuadPart );
+      return true;
+    }
+
+    void close() {
+      if ( size > 0 )
+        UnmapViewOfFile( data );
+      if ( mapping != nullptr )
+        CloseHandle( mapping );
+      if ( file != INVALID_HANDLE_VALUE )
+        CloseHandle( file );
+      file = INVALID_HANDLE_VALUE;
+      mapping = nullptr;
+      data = "";
+      size = 0;
+    }
+
+    ~MappedFile() { close(); }
+  };
+
+  static bool writeAll( HANDLE pHandle, const std::string& pData ) {
+    const char* data = pData.data();
+    size_t left = pData.size();
+    while ( left > 0 ) {
+      DWORD written = 0;
+      const auto chunk = static_cast<DWORD>( std::min<size_t>( left, 0x40000000 ) );
+      if (! WriteFile( pHandle, data, chunk, &written, nullptr ) || written == 0 )
+        return false;
+      data += written;
+      left -= written;
+    }
+    return true;
+  }
+
+  int fail( int pCode, const char* pWhat, const char* pFile, const char* pSep = "", const char* pWhy = "" ) {
+    m_Error = std::string{ pWhat } + pFile + pSep + pWhy;
+    return pCode;
+  }
+
+  GetFilename_t m_WineGetDosFilename{ nullptr };
+  bool m_Debug;
+  std::string m_Error;
+  // Unix directories (and paths which can't be split up) -> DOS paths, as
+  // response files keep repeating the same include and object directories
+  std::unordered_map<std::string, std::string> m_Cache;
+  std::string m_Key;
+};
@@ -40,6 +40,49 @@ ln_s() {
     fi
 }
 
+# Moves $1.tmp to $1. Files are replaced like this rather than written in
+# place, which would also change all the files dedup linked them to.
+replace() {
+    mv -f "$1.tmp" "$1"
+}
+
+# When rerun on an installation that was updated (e.g. by vsdownload.py,
+# which only replaces the packages that changed), only the directories with
+# files that were added or replaced since the last run need to be processed
+# again. Moving or extracting files updates their ctime.
+STAMP=$DEST/.install-stamp
+changed() {
+    [ ! -f "$STAMP" ] || [ -n "$(find "$1" -cnewer "$STAMP" -print -quit)" ]
+}
+
+# fixheaders [-map_winsdk] [-no_fixinclude] dir... does what lowercase
+# -symlink and fixinclude do, walking the given directories in parallel,
+# each of them once. Without python3, the perl scripts are run one by one.
+fixheaders() {
+    if command -v python3 >/dev/null; then
+        $ORIG/fixheaders "$@"
+        return
+    fi
+    map_opt=
+    do_fixinclude=1
+    for dir; do
+        case "$dir" in
+        -map_winsdk)
+            map_opt=-map_winsdk
+            ;;
+        -no_fixinclude)
+            do_fixinclude=
+            ;;
+        *)
+            $ORIG/lowercase $map_opt -symlink "$dir"
+            if [ -n "$do_fixinclude" ]; then
+                $ORIG/fixinclude $map_opt "$dir"
+            fi
+            ;;
+        esac
+    done
+}
+
 if [ -n "$VC_ZIP" ]; then
     unzip $VC_ZIP
 fi
@@ -71,8 +114,9 @@ cd ..
 # Thus process them to reference the other headers with lowercase names.
 # Also lowercase these files, as a few of them do have non-lowercase names,
 # and the call to fixinclude lowercases those references.
-$ORIG/lowercase -symlink include
-$ORIG/fixinclude include
+if changed include; then
+    fixheaders include
+fi
 cd bin
 # vctip.exe is known to cause problems at some times; just remove it.
 # See https://bugs.chromium.org/p/chromium/issues/detail?id=735226 and
@@ -125,34 +169,42 @@ echo Using SDK version $SDKVER
 # The original casing of file names is preserved though, by adding lowercase
 # symlinks instead of doing a plain rename, so files can be referred to with
 # either the out of the box filename or with the lowercase name.
+SDK_INCDIRS=
 for incdir in um shared winrt km; do
     SDK_INCDIR="kits/10/include/$SDKVER/$incdir"
 
-    if [ -d "$SDK_INCDIR" ]; then
-        $ORIG/lowercase -map_winsdk -symlink "$SDK_INCDIR"
-        $ORIG/fixinclude -map_winsdk "$SDK_INCDIR"
+    if [ -d "$SDK_INCDIR" ] && changed "$SDK_INCDIR"; then
+        SDK_INCDIRS="$SDK_INCDIRS $SDK_INCDIR"
     fi
 done
 
 # The WDF is a part of the Windows Driver Kit.
 WDF_INCDIR="kits/10/include/wdf"
-if [ -d "$WDF_INCDIR" ]; then
-    $ORIG/lowercase -map_winsdk -symlink "$WDF_INCDIR"
-    $ORIG/fixinclude -map_winsdk "$WDF_INCDIR"
+if [ -d "$WDF_INCDIR" ] && changed "$WDF_INCDIR"; then
+    SDK_INCDIRS="$SDK_INCDIRS $WDF_INCDIR"
+fi
+
+if [ -n "$SDK_INCDIRS" ]; then
+    fixheaders -map_winsdk $SDK_INCDIRS
 fi
 
+SDK_LIBDIRS=
 for arch in x86 x64 arm arm64; do
     SDK_LIBDIR="kits/10/lib/$SDKVER/um/$arch"
     DDK_LIBDIR="kits/10/lib/$SDKVER/km/$arch"
 
-    if [ -d "$SDK_LIBDIR" ]; then
-        $ORIG/lowercase -symlink "$SDK_LIBDIR"
+    if [ -d "$SDK_LIBDIR" ] && changed "$SDK_LIBDIR"; then
+        SDK_LIBDIRS="$SDK_LIBDIRS $SDK_LIBDIR"
     fi
-    if [ -d "$DDK_LIBDIR" ]; then
-        $ORIG/lowercase -symlink "$DDK_LIBDIR"
+    if [ -d "$DDK_LIBDIR" ] && changed "$DDK_LIBDIR"; then
+        SDK_LIBDIRS="$SDK_LIBDIRS $DDK_LIBDIR"
     fi
 done
 
+if [ -n "$SDK_LIBDIRS" ]; then
+    fixheaders -no_fixinclude $SDK_LIBDIRS
+fi
+
 host=x64
 # .NET-based tools use different host arch directories
 dotnet_host=amd64
@@ -169,22 +221,86 @@ if [ -d "VC/Tools/MSVC/$MSVCVER/modules" ]; then
     ln_s VC/Tools/MSVC/$MSVCVER/modules modules
 fi
 
+# Resolve the DOS path of the installation once here, so that msvcenv.sh
+# doesn't need to launch winepath every time it is sourced.
+INSTALL_BASE=
+INSTALL_WINEPREFIX=${WINEPREFIX:-$HOME/.wine}
+case "$DEST$INSTALL_WINEPREFIX" in
+*[\'\\\&\|]*)
+    ;;
+*)
+    if command -v winepath >/dev/null; then
+        INSTALL_BASE=$(WINEDEBUG=-all winepath -w "$DEST" 2>/dev/null | sed 's/[\\&|]/\\&/g')
+    fi
+    ;;
+esac
+
 cat $ORIG/wrappers/msvcenv.sh \
 | sed 's/MSVCVER=.*/MSVCVER='$MSVCVER/ \
 | sed 's/SDKVER=.*/SDKVER='$SDKVER/ \
 | sed s/x64/$host/ \
 | sed s/amd64/$dotnet_host/ \
-> msvcenv.sh
+| if [ -n "$INSTALL_BASE" ]; then
+    sed -e "s|^INSTALL_BASE_UNIX=.*|INSTALL_BASE_UNIX='$DEST'|" \
+        -e "s|^INSTALL_BASE=.*|INSTALL_BASE='$INSTALL_BASE'|" \
+        -e "s|^INSTALL_WINEPREFIX=.*|INSTALL_WINEPREFIX='$INSTALL_WINEPREFIX'|"
+else
+    cat
+fi \
+| sed '/^ARCH=/d' \
+> msvcenv.sh.tmp
 
+# The wrappers are installed once, in bin/wrappers, and each bin/$arch only
+# has symlinks to them, next to a msvcenv.sh that sets ARCH and sources the
+# shared one. The wrappers find everything relative to the name they were
+# run by, so they pick up the msvcenv.sh of the architecture.
+mkdir -p bin/wrappers
+for i in $ORIG/wrappers/*; do
+    i=$(basename $i)
+    if [ "$i" != msvcenv.sh ]; then
+        rm -f bin/wrappers/$i.tmp
+        cp -a $ORIG/wrappers/$i bin/wrappers/$i.tmp
+        replace bin/wrappers/$i
+    fi
+done
+mv -f msvcenv.sh.tmp bin/wrappers/msvcenv.sh
 for arch in x86 x64 arm arm64; do
     if [ ! -d "vc/tools/msvc/$MSVCVER/bin/Hostx64/$arch" ]; then
         continue
     fi
     mkdir -p bin/$arch
-    cp -a $ORIG/wrappers/* bin/$arch
-    cat msvcenv.sh | sed 's/ARCH=.*/ARCH='$arch/ > bin/$arch/msvcenv.sh
+    for i in $ORIG/wrappers/*; do
+        i=$(basename $i)
+        if [ "$i" != msvcenv.sh ]; then
+            ln -sfn ../wrappers/$i bin/$arch/$i
+        fi
+    done
+    cat > bin/$arch/msvcenv.sh.tmp <<EOF
+#!/bin/bash
+# See ../wrappers/msvcenv.sh, for all but the target architecture.
+ARCH=$arch
+. "\${BASH_SOURCE[0]%/*}/../wrappers/msvcenv.sh"
+EOF
+    replace bin/$arch/msvcenv.sh
 done
-rm msvcenv.sh
+
+# A case insensitive VFS overlay of the headers and libraries, for clang and
+# lld (see msvcenv-native.sh), with the directories spelled like in the
+# INCLUDE and LIB variables of msvcenv.sh.
+if command -v python3 >/dev/null; then
+    VFS_DIRS="$DEST/vc/tools/msvc/$MSVCVER/include"
+    for incdir in shared ucrt um winrt km; do
+        VFS_DIRS="$VFS_DIRS $DEST/kits/10/include/$SDKVER/$incdir"
+    done
+    for arch in x86 x64 arm arm64; do
+        VFS_DIRS="$VFS_DIRS $DEST/vc/tools/msvc/$MSVCVER/lib/$arch"
+        for libdir in ucrt um km; do
+            VFS_DIRS="$VFS_DIRS $DEST/kits/10/lib/$SDKVER/$libdir/$arch"
+        done
+    done
+    $ORIG/vfsoverlay $VFS_DIRS > vfsoverlay.yaml.tmp
+    replace vfsoverlay.yaml
+fi
 
 if [ -d "$DEST/bin/$host" ]; then
     if WINE="$(command -v wine64 || command -v wine)"; then
@@ -209,3 +325,12 @@ if [ -d "$DEST/bin/$host" ]; then
         fi
     fi
 fi
+
+# Replace identical files (e.g. the DLLs in every bin/Host*/<arch>) with
+# hardlinks. This comes before updating the stamp, as linking a file
+# updates its ctime.
+if command -v python3 >/dev/null; then
+    $ORIG/dedup "$DEST"
+fi
+
+touch "$STAMP"
@@ -33,9 +33,13 @@ else
     if [ ! -f "$ENV" ]; then
         echo $ENV doesn\'t exist
     else
-        export INCLUDE="$(bash -c ". $ENV && /bin/echo \"\$INCLUDE\"" | sed s/z://g | sed 's/\\/\//g')"
-        export LIB="$(bash -c ". $ENV && /bin/echo \"\$LIB\"" | sed s/z://g | sed 's/\\/\//g')"
-        MSVCARCH="$(bash -c ". $ENV && /bin/echo \"\$ARCH\"")"
+        # Source msvcenv.sh once, for all of INCLUDE, LIB, ARCH and BASE_UNIX,
+        # one per line.
+        MSVCENV="$(bash -c ". $ENV && printf '%s\n' \"\$INCLUDE\" \"\$LIB\" \"\$ARCH\" \"\$BASE_UNIX\"" | sed '1,2{ s/z://g; s/\\/\//g; }')"
+        { read -r INCLUDE; read -r LIB; read -r MSVCARCH; read -r MSVCBASE_UNIX; } <<EOF
+$MSVCENV
+EOF
+        export INCLUDE LIB
         case $MSVCARCH in
         x86) TARGET_ARCH=i686 ;;
         x64) TARGET_ARCH=x86_64 ;;
@@ -43,5 +47,15 @@ else
         arm64) TARGET_ARCH=aarch64 ;;
         esac
         TARGET_TRIPLE=$TARGET_ARCH-windows-msvc
+        # A case insensitive VFS overlay of the headers and libraries, which
+        # spares looking them up through the lowercase symlinks, e.g. with
+        # clang-cl $VFSOVERLAY_FLAGS or lld-link /vfsoverlay:$VFSOVERLAY.
+        VFSOVERLAY="$MSVCBASE_UNIX/vfsoverlay.yaml"
+        if [ -f "$VFSOVERLAY" ]; then
+            export VFSOVERLAY
+            export VFSOVERLAY_FLAGS="-Xclang -ivfsoverlay -Xclang $VFSOVERLAY"
+        else
+            unset VFSOVERLAY VFSOVERLAY_FLAGS
+        fi
     fi
 fi
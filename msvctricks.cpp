@@ -15,76 +15,1474 @@
  */
 
 #include <windows.h>
+#include <psapi.h>
 #include <shlwapi.h>
 
+#include <algorithm>
+#include <cwchar>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
+
+#pragma comment(lib, "psapi.lib")
 #pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "shlwapi.lib")
 #pragma comment(linker, "/ENTRY:wWinMainCRTStartup")
 #pragma comment(linker, "/SUBSYSTEM:CONSOLE")
 
+#define CP_UNIXCP 65010  /* Wine extension */
+
+#include "cmaketricks.h"
+
+
+// The output filters, comma separated in WINE_MSVC_STDOUT_FILTER and
+// WINE_MSVC_STDERR_FILTER. These do what the equivalent sed expressions in
+// wine-msvc.sh do, without a sed process and FIFO per stream.
+enum
+{
+    FILTER_CR      = 1 << 0,  // s/\r//
+    FILTER_INCLUDE = 1 << 1,  // /showIncludes
+    FILTER_LINE    = 1 << 2,  // #line directives of /E
+    FILTER_DIAG    = 1 << 3,  // Warnings and Errors
+    FILTER_DUMPBIN = 1 << 4,  // dumpbin /PDBPATH
+};
+
+static unsigned parseFilters(const std::wstring& names)
+{
+    static const struct { LPCWSTR name; unsigned filter; } filters[] = {
+        { L"cr",      FILTER_CR },
+        { L"include", FILTER_INCLUDE },
+        { L"line",    FILTER_LINE },
+        { L"diag",    FILTER_DIAG },
+        { L"dumpbin", FILTER_DUMPBIN },
+    };
+
+    unsigned ret = 0;
+    for (size_t pos = 0; pos < names.size(); )
+    {
+        size_t end = names.find(L',', pos);
+        if (end == std::wstring::npos)
+            end = names.size();
+        for (const auto& f : filters)
+        {
+            if (names.compare(pos, end - pos, f.name) == 0)
+                ret |= f.filter;
+        }
+        pos = end + 1;
+    }
+    return ret;
+}
+
+static bool startsWith(const std::string& line, const char* prefix)
+{
+    return line.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// s/z:([\\/])/\1/i, or with the g flag if all is set
+static void stripDrive(std::string& line, bool all)
+{
+    for (size_t i = 0; i + 2 < line.size(); ++i)
+    {
+        if ((line[i] == 'z' || line[i] == 'Z') && line[i + 1] == ':' &&
+            (line[i + 2] == '\\' || line[i + 2] == '/'))
+        {
+            line.erase(i, 2);
+            if (!all)
+                break;
+        }
+    }
+}
+
+// s,from,to,g
+static void replaceAll(std::string& line, const char* from, char to)
+{
+    const size_t len = strlen(from);
+    for (size_t i = 0; (i = line.find(from, i, len)) != std::string::npos; ++i)
+        line.replace(i, len, 1, to);
+}
+
+// ^[[:blank:]]*#[[:blank:]]*line[[:blank:]]
+static bool isLineDirective(const std::string& line)
+{
+    size_t i = 0;
+    while (i < line.size() && isBlank(line[i]))
+        ++i;
+    if (i == line.size() || line[i++] != '#')
+        return false;
+    while (i < line.size() && isBlank(line[i]))
+        ++i;
+    return line.compare(i, 4, "line") == 0 && i + 4 < line.size() && isBlank(line[i + 4]);
+}
+
+// ^[zZ]:.*\([[:digit:]]+\): (note|error C[[:digit:]]{4}|warning C[[:digit:]]{4}): 
+static bool isDiagnostic(const std::string& line)
+{
+    if (line.size() < 2 || (line[0] != 'z' && line[0] != 'Z') || line[1] != ':')
+        return false;
+
+    const auto digits = [&line](size_t i, size_t n) {
+        for (; n > 0; --n, ++i)
+        {
+            if (i >= line.size() || line[i] < '0' || line[i] > '9')
+                return false;
+        }
+        return true;
+    };
+
+    for (size_t i = 2; (i = line.find('(', i)) != std::string::npos; ++i)
+    {
+        size_t j = i + 1;
+        while (digits(j, 1))
+            ++j;
+        if (j == i + 1 || line.compare(j, 3, "): ") != 0)
+            continue;
+        j += 3;
+
+        if (line.compare(j, 4, "note") == 0)
+            j += 4;
+        else if (line.compare(j, 7, "error C") == 0 && digits(j + 7, 4))
+            j += 11;
+        else if (line.compare(j, 9, "warning C") == 0 && digits(j + 9, 4))
+            j += 13;
+        else
+            continue;
+
+        if (line.compare(j, 2, ": ") == 0)
+            return true;
+    }
+    return false;
+}
+
+static void filterLine(std::string& line, unsigned filters)
+{
+    if (filters & FILTER_CR)
+    {
+        size_t cr = line.find('\r');
+        if (cr != std::string::npos)
+            line.erase(cr, 1);
+    }
+    if ((filters & FILTER_INCLUDE) && startsWith(line, "Note: including file: "))
+    {
+        stripDrive(line, false);
+        replaceAll(line, "\\", '/');
+    }
+    if ((filters & FILTER_LINE) && isLineDirective(line))
+    {
+        stripDrive(line, false);
+        replaceAll(line, "\\\\", '/');
+    }
+    if ((filters & FILTER_DIAG) && isDiagnostic(line))
+    {
+        stripDrive(line, true);
+        replaceAll(line, "\\", '/');
+    }
+    if ((filters & FILTER_DUMPBIN) && (startsWith(line, "Dump of file ") || startsWith(line, "  PDB file found at ")))
+    {
+        stripDrive(line, false);
+        replaceAll(line, "\\", '/');
+    }
+}
+
+// The files of the /showIncludes notes of a compile, for the depfile in
+// WINE_MSVC_DEPFILE. The notes are left out of the output, unless
+// WINE_MSVC_DEPFILE_NOTES is set.
+struct Deps
+{
+    std::wstring path;
+    std::string target;  // WINE_MSVC_DEPFILE_TARGET
+    bool keepNotes = false;
+    std::vector<std::string> files;
+    std::unordered_set<std::string> seen;
+
+    // Returns whether the (filtered) line is a note to leave out.
+    bool add(const std::string& line)
+    {
+        static const char prefix[] = "Note: including file:";
+        if (!startsWith(line, prefix))
+            return false;
+        size_t begin = line.find_first_not_of(' ', sizeof(prefix) - 1);
+        size_t end = line.find_last_not_of("\r") + 1;
+        if (begin != std::string::npos && begin < end)
+        {
+            std::string file = line.substr(begin, end - begin);
+            if (seen.insert(file).second)
+                files.push_back(file);
+        }
+        return !keepNotes;
+    }
+};
+
+// A filtered output stream of the tool: it writes into a pipe, which is read
+// line by line, filtered, and written on to the real stdout or stderr.
+struct Output
+{
+    HANDLE hTarget = INVALID_HANDLE_VALUE;
+    HANDLE hPipe   = INVALID_HANDLE_VALUE;  // our end of the pipe
+    HANDLE hChild  = INVALID_HANDLE_VALUE;  // the end the tool writes to
+    unsigned filters = 0;
+    Deps* deps = nullptr;
+    OVERLAPPED ov = {};
+    bool reading = false;
+    char buf[4096];
+    std::string line;
+
+    bool open(HANDLE target, unsigned outputFilters)
+    {
+        static volatile LONG counter = 0;
+        wchar_t name[64];
+        wsprintfW(name, L"\\\\.\\pipe\\msvctricks.%lu.%ld", GetCurrentProcessId(), InterlockedIncrement(&counter));
+
+        hPipe = CreateNamedPipeW(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0, 65536, 0, nullptr);
+        if (hPipe == INVALID_HANDLE_VALUE)
+            return false;
+
+        // Not inheritable; run() lets only the tool inherit it.
+        hChild = CreateFileW(name, GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (hChild == INVALID_HANDLE_VALUE || !ov.hEvent)
+            return false;
+
+        hTarget = target;
+        filters = outputFilters;
+        return true;
+    }
+
+    ~Output()
+    {
+        for (HANDLE h : { hPipe, hChild })
+        {
+            if (h != INVALID_HANDLE_VALUE)
+                CloseHandle(h);
+        }
+        if (ov.hEvent)
+            CloseHandle(ov.hEvent);
+    }
+
+    // Filters all complete lines, and the incomplete last one too at the end.
+    void flush(bool end)
+    {
+        std::string out;
+        size_t pos = 0, eol;
+        while ((eol = line.find('\n', pos)) != std::string::npos)
+        {
+            std::string l = line.substr(pos, eol - pos);
+            filterLine(l, filters);
+            if (!deps || !deps->add(l))
+            {
+                out += l;
+                out += '\n';
+            }
+            pos = eol + 1;
+        }
+        line.erase(0, pos);
+        if (end && !line.empty())
+        {
+            filterLine(line, filters);
+            if (!deps || !deps->add(line))
+                out += line;
+            line.clear();
+        }
+
+        DWORD dwWritten;
+        if (!out.empty())
+            WriteFile(hTarget, out.data(), (DWORD) out.size(), &dwWritten, nullptr);
+    }
+
+    void close()
+    {
+        CloseHandle(hPipe);
+        hPipe = INVALID_HANDLE_VALUE;
+        reading = false;
+    }
+
+    // Reads whatever is there, until a read is left pending.
+    void read()
+    {
+        while (hPipe != INVALID_HANDLE_VALUE && !reading)
+        {
+            DWORD dwRead;
+            if (!ReadFile(hPipe, buf, sizeof(buf), nullptr, &ov) && GetLastError() != ERROR_IO_PENDING)
+                close();
+            else if (GetOverlappedResult(hPipe, &ov, &dwRead, FALSE))
+                line.append(buf, dwRead);
+            else if (GetLastError() == ERROR_IO_INCOMPLETE)
+                reading = true;
+            else
+                close();
+        }
+        flush(false);
+    }
+
+    // The pending read is done
+    void complete()
+    {
+        DWORD dwRead;
+        if (GetOverlappedResult(hPipe, &ov, &dwRead, FALSE))
+        {
+            line.append(buf, dwRead);
+            reading = false;
+            read();
+        }
+        else if (GetLastError() != ERROR_IO_INCOMPLETE)
+        {
+            close();
+        }
+    }
+
+    // Called once the tool has exited. Processes it leaves behind, like
+    // mspdbsrv.exe, may still have the pipe open, so read what is left
+    // instead of waiting for the end of the pipe.
+    void drain()
+    {
+        read();
+        while (hPipe != INVALID_HANDLE_VALUE)
+        {
+            DWORD dwAvail = 0;
+            if (PeekNamedPipe(hPipe, nullptr, 0, nullptr, &dwAvail, nullptr) && dwAvail > 0)
+            {
+                WaitForSingleObject(ov.hEvent, INFINITE);
+                complete();
+                continue;
+            }
+
+            DWORD dwRead;
+            CancelIo(hPipe);
+            if (GetOverlappedResult(hPipe, &ov, &dwRead, TRUE))
+                line.append(buf, dwRead);
+            close();
+        }
+        flush(true);
+    }
+};
 
-static HANDLE hStdIn  = INVALID_HANDLE_VALUE;
-static HANDLE hStdOut = INVALID_HANDLE_VALUE;
-static HANDLE hStdErr = INVALID_HANDLE_VALUE;
-static HANDLE hChildJob;
+// The resources a tool used, for WINE_MSVC_STATS. The times are in 100ns
+// units, like FILETIMEs.
+struct Stats
+{
+    ULONGLONG wallTime = 0;
+    ULONGLONG userTime = 0;
+    ULONGLONG kernelTime = 0;
+    ULONGLONG peakMemory = 0;
+    ULONGLONG readBytes = 0;
+    ULONGLONG writeBytes = 0;
+};
 
-static DWORD run(LPWSTR lpCmdLine)
+// The limits of the tools, from the WINE_MSVC_JOB_* and WINE_MSVC_HEAVY_*
+// variables. Zero means unlimited.
+struct Limits
 {
-    STARTUPINFOW si = {};
-    si.cb = sizeof(si);
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.hStdInput = hStdIn;
-    si.hStdOutput = hStdOut;
-    si.hStdError = hStdErr;
+    SIZE_T memory = 0;           // WINE_MSVC_JOB_MEMORY, in MB per process
+    DWORD cpuRate = 0;           // WINE_MSVC_JOB_CPU_RATE, in percent of all CPUs
+    DWORD priorityClass = 0;     // WINE_MSVC_JOB_PRIORITY
+    DWORD heavyJobs = 0;         // WINE_MSVC_HEAVY_JOBS
+    std::wstring heavyTools = L"link.exe";  // WINE_MSVC_HEAVY_TOOLS
+
+    // Reads the limits with var(name), which returns the value of a
+    // variable or an empty string.
+    template <typename Var>
+    void read(Var var)
+    {
+        memory = (SIZE_T) wcstoul(var(L"WINE_MSVC_JOB_MEMORY").c_str(), nullptr, 10) << 20;
+        cpuRate = wcstoul(var(L"WINE_MSVC_JOB_CPU_RATE").c_str(), nullptr, 10);
+        if (cpuRate > 100)
+            cpuRate = 0;
+        heavyJobs = wcstoul(var(L"WINE_MSVC_HEAVY_JOBS").c_str(), nullptr, 10);
+        if (heavyJobs > MAXIMUM_WAIT_OBJECTS)
+            heavyJobs = MAXIMUM_WAIT_OBJECTS;
+        std::wstring tools = var(L"WINE_MSVC_HEAVY_TOOLS");
+        if (!tools.empty())
+            heavyTools = tools;
+
+        static const struct { LPCWSTR name; DWORD value; } priorities[] = {
+            { L"idle",        IDLE_PRIORITY_CLASS },
+            { L"belownormal", BELOW_NORMAL_PRIORITY_CLASS },
+            { L"normal",      NORMAL_PRIORITY_CLASS },
+            { L"abovenormal", ABOVE_NORMAL_PRIORITY_CLASS },
+            { L"high",        HIGH_PRIORITY_CLASS },
+        };
+        std::wstring priority = var(L"WINE_MSVC_JOB_PRIORITY");
+        for (const auto& p : priorities)
+        {
+            if (_wcsicmp(priority.c_str(), p.name) == 0)
+                priorityClass = p.value;
+        }
+    }
+};
+
+// Where the spans of WINE_MSVC_TRACE go, see wine-msvc.sh.
+struct Trace
+{
+    std::wstring path;
+    std::string pid;  // WINE_MSVC_TRACE_PID, of the wrapper
+};
+
+struct Context
+{
+    HANDLE hStdIn  = INVALID_HANDLE_VALUE;
+    HANDLE hStdOut = INVALID_HANDLE_VALUE;
+    HANDLE hStdErr = INVALID_HANDLE_VALUE;
+    HANDLE hJob    = nullptr;
+    DWORD dwPriorityClass = 0;
+    LPWSTR lpEnvironment = nullptr;
+    LPCWSTR lpCurrentDirectory = nullptr;
+    Output* out = nullptr;
+    Output* err = nullptr;
+    Stats* stats = nullptr;
+    const Trace* trace = nullptr;
+};
+
+// Puts a filter between the tool and the given output handle, if any filters
+// are set, or the /showIncludes notes are to be collected into deps.
+static void filterOutput(HANDLE& hStd, Output*& output, Output& storage, const std::wstring& filters, Deps* deps = nullptr)
+{
+    unsigned f = parseFilters(filters);
+    if ((f || deps) && storage.open(hStd, f))
+    {
+        hStd = storage.hChild;
+        output = &storage;
+        storage.deps = deps;
+    }
+}
+
+// Waits for the tool to exit, while passing its output through the filters.
+static void wait(const Context& ctx, HANDLE hProcess)
+{
+    Output* outputs[] = { ctx.out, ctx.err };
+    for (Output* o : outputs)
+    {
+        if (o)
+        {
+            // Only the tool should have the other end of the pipe open,
+            // so that it breaks when the tool is done with it.
+            CloseHandle(o->hChild);
+            o->hChild = INVALID_HANDLE_VALUE;
+            o->read();
+        }
+    }
+
+    for (;;)
+    {
+        HANDLE handles[3] = { hProcess };
+        Output* owners[3] = {};
+        DWORD count = 1;
+        for (Output* o : outputs)
+        {
+            if (o && o->reading)
+            {
+                owners[count] = o;
+                handles[count++] = o->ov.hEvent;
+            }
+        }
+
+        DWORD ret = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+        if (ret > WAIT_OBJECT_0 && ret < WAIT_OBJECT_0 + count)
+            owners[ret - WAIT_OBJECT_0]->complete();
+        else
+            break;
+    }
+
+    for (Output* o : outputs)
+    {
+        if (o)
+            o->drain();
+    }
+}
+
+static ULONGLONG fileTime(const FILETIME& ft)
+{
+    return ((ULONGLONG) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+// Microseconds since the Unix epoch, the clock of EPOCHREALTIME in the
+// wrappers.
+static ULONGLONG traceNow()
+{
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    return (fileTime(ft) - 116444736000000000ull) / 10;
+}
+
+static ULONGLONG maxOf(ULONGLONG a, ULONGLONG b)
+{
+    return a > b ? a : b;
+}
+
+// Adds up what the job accounted for the tool, including any processes it
+// started itself. Where the job doesn't account for something (as is the
+// case in wine for most of it), the numbers of the tool process are used.
+static void collectStats(const Context& ctx, HANDLE hProcess, Stats& stats)
+{
+    FILETIME creation, exit, kernel, user;
+    if (GetProcessTimes(hProcess, &creation, &exit, &kernel, &user))
+    {
+        stats.userTime = fileTime(user);
+        stats.kernelTime = fileTime(kernel);
+    }
+
+    PROCESS_MEMORY_COUNTERS memory = {};
+    memory.cb = sizeof(memory);
+    if (GetProcessMemoryInfo(hProcess, &memory, sizeof(memory)))
+        stats.peakMemory = memory.PeakWorkingSetSize;
+
+    IO_COUNTERS io = {};
+    if (GetProcessIoCounters(hProcess, &io))
+    {
+        stats.readBytes = io.ReadTransferCount;
+        stats.writeBytes = io.WriteTransferCount;
+    }
+
+    if (!ctx.hJob)
+        return;
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION account = {};
+    if (QueryInformationJobObject(ctx.hJob, JobObjectBasicAndIoAccountingInformation, &account, sizeof(account), nullptr))
+    {
+        stats.userTime = maxOf(stats.userTime, account.BasicInfo.TotalUserTime.QuadPart);
+        stats.kernelTime = maxOf(stats.kernelTime, account.BasicInfo.TotalKernelTime.QuadPart);
+        stats.readBytes = maxOf(stats.readBytes, account.IoInfo.ReadTransferCount);
+        stats.writeBytes = maxOf(stats.writeBytes, account.IoInfo.WriteTransferCount);
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    if (QueryInformationJobObject(ctx.hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr))
+        stats.peakMemory = maxOf(stats.peakMemory, limits.PeakProcessMemoryUsed);
+}
+
+// Held while a tool is started, see run().
+static SRWLOCK g_createProcessLock = SRWLOCK_INIT;
+
+// Starts the tool with only its own standard handles inherited. The server
+// runs several jobs at once, and a tool that inherited the output pipe of
+// another job would keep it open, e.g. for as long as mspdbsrv.exe runs,
+// so that the reader of the pipe never sees its end. The handles are listed
+// in PROC_THREAD_ATTRIBUTE_HANDLE_LIST, and in case that isn't supported,
+// they are also only made inheritable while no other tool is being started.
+static DWORD run(const Context& ctx, LPWSTR lpCmdLine)
+{
+    STARTUPINFOEXW si = {};
+    si.StartupInfo.cb = sizeof(si.StartupInfo);
+    si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    si.StartupInfo.hStdInput = ctx.hStdIn;
+    si.StartupInfo.hStdOutput = ctx.hStdOut;
+    si.StartupInfo.hStdError = ctx.hStdErr;
 
     PROCESS_INFORMATION pi = {};
 
+    DWORD dwCreationFlags = ctx.dwPriorityClass;
+    if (ctx.lpEnvironment)
+    {
+        dwCreationFlags |= CREATE_UNICODE_ENVIRONMENT;
+    }
+
+    // The list must not have duplicates.
+    HANDLE handles[3];
+    DWORD dwHandles = 0;
+    for (HANDLE h : { ctx.hStdIn, ctx.hStdOut, ctx.hStdErr })
+    {
+        if (h && h != INVALID_HANDLE_VALUE && std::find(handles, handles + dwHandles, h) == handles + dwHandles)
+            handles[dwHandles++] = h;
+    }
+
+    SIZE_T size = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &size);
+    std::vector<char> attributes(size);
+    if (dwHandles && size)
+    {
+        si.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.data());
+        if (!InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &size))
+        {
+            si.lpAttributeList = nullptr;
+        }
+        else if (UpdateProcThreadAttribute(si.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                           handles, dwHandles * sizeof(HANDLE), nullptr, nullptr))
+        {
+            si.StartupInfo.cb = sizeof(si);
+            dwCreationFlags |= EXTENDED_STARTUPINFO_PRESENT;
+        }
+    }
+
+    AcquireSRWLockExclusive(&g_createProcessLock);
+    DWORD flags[3] = {};
+    for (DWORD i = 0; i < dwHandles; ++i)
+    {
+        GetHandleInformation(handles[i], &flags[i]);
+        SetHandleInformation(handles[i], HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+    ULONGLONG start = GetTickCount64();
+    BOOL created = CreateProcessW(nullptr, lpCmdLine, nullptr, nullptr, TRUE, dwCreationFlags,
+                                  ctx.lpEnvironment, ctx.lpCurrentDirectory, &si.StartupInfo, &pi);
+    DWORD dwError = GetLastError();
+    for (DWORD i = 0; i < dwHandles; ++i)
+    {
+        SetHandleInformation(handles[i], HANDLE_FLAG_INHERIT, flags[i] & HANDLE_FLAG_INHERIT);
+    }
+    ReleaseSRWLockExclusive(&g_createProcessLock);
+
+    if (si.lpAttributeList)
+    {
+        DeleteProcThreadAttributeList(si.lpAttributeList);
+    }
+
     DWORD dwExitCode;
-    if (CreateProcessW(nullptr, lpCmdLine, nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi))
+    if (created)
     {
-        if (hChildJob)
+        if (ctx.hJob)
         {
-            AssignProcessToJobObject(hChildJob, pi.hProcess);
+            AssignProcessToJobObject(ctx.hJob, pi.hProcess);
         }
 
-        WaitForSingleObject(pi.hProcess, INFINITE);
+        wait(ctx, pi.hProcess);
 
         if (!GetExitCodeProcess(pi.hProcess, &dwExitCode))
         {
             dwExitCode = GetLastError();
         }
 
+        if (ctx.stats)
+        {
+            ctx.stats->wallTime = (GetTickCount64() - start) * 10000;
+            collectStats(ctx, pi.hProcess, *ctx.stats);
+        }
+
         CloseHandle(pi.hProcess);
         CloseHandle(pi.hThread);
     }
     else
     {
-        dwExitCode = GetLastError();
+        dwExitCode = dwError;
     }
 
     return dwExitCode;
 }
 
-static DWORD mt(LPWSTR lpCmdLine)
+static DWORD mt(const Context& ctx, LPWSTR lpCmdLine)
 {
-    DWORD dwExitCode = run(lpCmdLine);
+    DWORD dwExitCode = run(ctx, lpCmdLine);
     // https://gitlab.kitware.com/cmake/cmake/-/blob/v3.26.0/Source/cmcmd.cxx#L2405
     if (dwExitCode == 0x41020001)
         dwExitCode = 0xbb;
     return dwExitCode;
 }
 
+static DWORD tool(const Context& ctx, LPCWSTR exe, LPWSTR lpCmdLine)
+{
+    if (PathMatchSpecW(PathFindFileNameW(exe), L"mt.exe"))
+        return mt(ctx, lpCmdLine);
+
+    return run(ctx, lpCmdLine);
+}
+
+static HANDLE createChildJob(const Limits& limits)
+{
+    HANDLE hJob = CreateJobObjectW(nullptr, nullptr);
+    if (hJob)
+    {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = {};
+        info.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE
+                                              | JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
+        SetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &info, sizeof(info));
+
+        // Set separately, so that the above still applies where these
+        // limits aren't supported.
+        if (limits.memory)
+        {
+            info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+            info.ProcessMemoryLimit = limits.memory;
+            SetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &info, sizeof(info));
+        }
+        if (limits.cpuRate)
+        {
+            JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate = {};
+            rate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE
+                              | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+            rate.CpuRate = limits.cpuRate * 100;
+            SetInformationJobObject(hJob, JobObjectCpuRateControlInformation, &rate, sizeof(rate));
+        }
+    }
+    return hJob;
+}
+
+// Waits for one of the WINE_MSVC_HEAVY_JOBS slots for running a tool out of
+// WINE_MSVC_HEAVY_TOOLS (file name patterns separated by semicolons), which
+// are shared by all msvctricks processes and servers in the wineserver. The
+// slots are named mutexes rather than a semaphore, as a mutex is released
+// when its owner dies. Named objects only exist within one wineserver, so
+// wine-msvc.sh takes the slots itself when it can, with flock, which holds
+// across server shards, and sets WINE_MSVC_HEAVY_JOBS=0 for msvctricks.
+// Returns the slot to release with releaseHeavySlot(), or nullptr if the
+// tool isn't limited.
+static HANDLE acquireHeavySlot(const Limits& limits, LPCWSTR exe)
+{
+    if (!limits.heavyJobs || !PathMatchSpecW(PathFindFileNameW(exe), limits.heavyTools.c_str()))
+        return nullptr;
+
+    HANDLE slots[MAXIMUM_WAIT_OBJECTS];
+    DWORD count = 0;
+    for (; count < limits.heavyJobs; ++count)
+    {
+        wchar_t name[64];
+        wsprintfW(name, L"Local\\wine-msvc-heavy-%u", (UINT) count);
+        slots[count] = CreateMutexW(nullptr, FALSE, name);
+        if (!slots[count])
+            break;
+    }
+
+    HANDLE hSlot = nullptr;
+    DWORD ret = count ? WaitForMultipleObjects(count, slots, FALSE, INFINITE) : WAIT_FAILED;
+    if (ret < WAIT_OBJECT_0 + count)
+        hSlot = slots[ret - WAIT_OBJECT_0];
+    else if (ret >= WAIT_ABANDONED_0 && ret < WAIT_ABANDONED_0 + count)
+        hSlot = slots[ret - WAIT_ABANDONED_0];
+
+    for (DWORD i = 0; i < count; ++i)
+    {
+        if (slots[i] != hSlot)
+            CloseHandle(slots[i]);
+    }
+    return hSlot;
+}
+
+static void releaseHeavySlot(HANDLE hSlot)
+{
+    if (hSlot)
+    {
+        ReleaseMutex(hSlot);
+        CloseHandle(hSlot);
+    }
+}
+
+static std::wstring widen(const std::string& str)
+{
+    std::wstring wstr(str.size(), L'\0');
+    int len = MultiByteToWideChar(CP_UNIXCP, 0, str.data(), (int) str.size(), &wstr[0], (int) wstr.size());
+    wstr.resize(len > 0 ? len : 0);
+    return wstr;
+}
+
+static std::string narrow(const std::wstring& wstr)
+{
+    std::string str(wstr.size() * 4, '\0');
+    int len = WideCharToMultiByte(CP_UNIXCP, 0, wstr.data(), (int) wstr.size(), &str[0], (int) str.size(), nullptr, nullptr);
+    str.resize(len > 0 ? len : 0);
+    return str;
+}
+
+// Translates a Unix path into a DOS path, the same way winepath -w does.
+static std::wstring dosPath(const std::string& path)
+{
+    using wine_get_dos_file_name_t = LPWSTR (CDECL *)(LPCSTR);
+    static const auto wine_get_dos_file_name = reinterpret_cast<wine_get_dos_file_name_t>(
+        GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "wine_get_dos_file_name"));
+
+    if (wine_get_dos_file_name && !path.empty() && path[0] == '/')
+    {
+        if (LPWSTR dos = wine_get_dos_file_name(path.c_str()))
+        {
+            std::wstring ret = dos;
+            HeapFree(GetProcessHeap(), 0, dos);
+            return ret;
+        }
+    }
+    return widen(path);
+}
+
+static bool readFile(const std::wstring& path, std::string& data)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    char buf[4096];
+    DWORD dwRead;
+    while (ReadFile(hFile, buf, sizeof(buf), &dwRead, nullptr) && dwRead > 0)
+    {
+        data.append(buf, dwRead);
+    }
+
+    CloseHandle(hFile);
+    return true;
+}
+
+// Quotes an argument so that CommandLineToArgvW() gives it back verbatim.
+static void appendArg(std::wstring& cmdline, const std::wstring& arg)
+{
+    if (!cmdline.empty())
+        cmdline += L' ';
+
+    if (!arg.empty() && arg.find_first_of(L" \t\n\v\"") == std::wstring::npos)
+    {
+        cmdline += arg;
+        return;
+    }
+
+    cmdline += L'"';
+    for (size_t i = 0; ; ++i)
+    {
+        size_t backslashes = 0;
+        while (i < arg.size() && arg[i] == L'\\')
+        {
+            ++i;
+            ++backslashes;
+        }
+
+        if (i == arg.size())
+        {
+            cmdline.append(backslashes * 2, L'\\');
+            break;
+        }
+        else if (arg[i] == L'"')
+        {
+            cmdline.append(backslashes * 2 + 1, L'\\');
+            cmdline += L'"';
+        }
+        else
+        {
+            cmdline.append(backslashes, L'\\');
+            cmdline += arg[i];
+        }
+    }
+    cmdline += L'"';
+}
+
+// Unixifies the line [in, next) of a file, into out, which may be in itself
+// as the filters only ever remove characters. Returns the end of the output.
+static char* fixupLine(const char* in, const char* next, char* out, std::string& line)
+{
+    const char* c = in;
+    while (c < next && isBlank(*c))
+        ++c;
+    if (c < next && *c == '#')
+    {
+        line.assign(in, next);
+        filterLine(line, FILTER_CR | FILTER_LINE);
+        memcpy(out, line.data(), line.size());
+        return out + line.size();
+    }
+
+    // just s/\r//
+    const char* cr = static_cast<const char*>(memchr(in, '\r', next - in));
+    if (cr)
+    {
+        memmove(out, in, cr - in);
+        out += cr - in;
+        in = cr + 1;
+    }
+    if (out != in)
+        memmove(out, in, next - in);
+    return out + (next - in);
+}
+
+// Unixifies the lines of a file that is open for reading and writing, in
+// place, by mapping it. Sets mapped to whether it could be mapped at all.
+static bool fixupMapped(HANDLE hFile, LARGE_INTEGER size, bool& mapped)
+{
+    mapped = false;
+    HANDLE hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!hMapping)
+        return false;
+    char* data = static_cast<char*>(MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, 0));
+    if (!data)
+    {
+        CloseHandle(hMapping);
+        return false;
+    }
+    mapped = true;
+
+    const char* end = data + size.QuadPart;
+    const char* in = data;
+    char* out = data;
+    std::string line;
+    while (in < end)
+    {
+        const char* eol = static_cast<const char*>(memchr(in, '\n', end - in));
+        const char* next = eol ? eol + 1 : end;
+        out = fixupLine(in, next, out, line);
+        in = next;
+    }
+
+    UnmapViewOfFile(data);
+    CloseHandle(hMapping);
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = out - data;
+    return pos.QuadPart == size.QuadPart || (SetFilePointerEx(hFile, pos, nullptr, FILE_BEGIN) && SetEndOfFile(hFile));
+}
+
+// The same, but by reading the file in chunks and writing each back behind
+// where it was read, for when it can't be mapped, e.g. when it is larger
+// than the address space.
+static bool fixupStreamed(HANDLE hFile)
+{
+    std::vector<char> buf(1 << 20);
+    std::string line;
+    LARGE_INTEGER readPos = {}, writePos = {};
+    size_t used = 0;
+    bool eof = false;
+    while (!eof)
+    {
+        if (used == buf.size())
+            buf.resize(buf.size() * 2);
+        DWORD dwRead;
+        if (!SetFilePointerEx(hFile, readPos, nullptr, FILE_BEGIN) ||
+            !ReadFile(hFile, &buf[used], (DWORD) (buf.size() - used), &dwRead, nullptr))
+            return false;
+        readPos.QuadPart += dwRead;
+        used += dwRead;
+        eof = dwRead == 0;
+
+        // All complete lines, and at the end the rest too
+        const char* end = buf.data() + used;
+        const char* in = buf.data();
+        char* out = buf.data();
+        while (in < end)
+        {
+            const char* eol = static_cast<const char*>(memchr(in, '\n', end - in));
+            if (!eol && !eof)
+                break;
+            const char* next = eol ? eol + 1 : end;
+            out = fixupLine(in, next, out, line);
+            in = next;
+        }
+
+        DWORD dwWritten;
+        DWORD dwOut = (DWORD) (out - buf.data());
+        if (dwOut && (!SetFilePointerEx(hFile, writePos, nullptr, FILE_BEGIN) ||
+                      !WriteFile(hFile, buf.data(), dwOut, &dwWritten, nullptr) || dwWritten != dwOut))
+            return false;
+        writePos.QuadPart += dwOut;
+        used = end - in;
+        memmove(buf.data(), in, used);
+    }
+
+    return writePos.QuadPart == readPos.QuadPart || (SetFilePointerEx(hFile, writePos, nullptr, FILE_BEGIN) && SetEndOfFile(hFile));
+}
+
+// Unixifies the #line directives of a file the tool wrote, such as the output
+// of cl /P, as named by WINE_MSVC_FIXUP_LINE. This is the cr and line filter
+// applied to every line, but as both only ever remove characters, the file
+// is rewritten in place in a single pass, and truncated at the end. If that
+// fails, it says so on hErr, the stderr of the tool, and returns the error.
+static DWORD fixupLines(const std::wstring& path, HANDLE hErr)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    // Something, like a process the tool left behind, may still have it open.
+    if (hFile == INVALID_HANDLE_VALUE && GetLastError() == ERROR_SHARING_VIOLATION)
+        hFile = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    bool fixed = false;
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        bool mapped;
+        if (GetFileSizeEx(hFile, &size))
+            fixed = size.QuadPart == 0 || fixupMapped(hFile, size, mapped) || (!mapped && fixupStreamed(hFile));
+    }
+    DWORD dwError = fixed ? 0 : GetLastError();
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+
+    if (!fixed)
+    {
+        if (!dwError)
+            dwError = ERROR_WRITE_FAULT;
+        char code[16];
+        wsprintfA(code, "%lu", dwError);
+        std::string msg = "msvctricks: can't fix up the #line directives of " + narrow(path) + ": error " + code + "\n";
+        DWORD dwWritten;
+        WriteFile(hErr, msg.data(), (DWORD) msg.size(), &dwWritten, nullptr);
+    }
+    return dwError;
+}
+
+// Resolves a path given to the tool.
+static std::wstring toolPath(const std::wstring& path, const std::string& cwd)
+{
+    std::string unixPath = narrow(path);
+    if (!unixPath.empty() && unixPath[0] != '/' && !cwd.empty())
+        unixPath = cwd + "/" + unixPath;
+    return dosPath(unixPath);
+}
+
+// Sets up tracing to the path of WINE_MSVC_TRACE, relative to cwd if given,
+// with the spans under the pid of WINE_MSVC_TRACE_PID, if set.
+static void openTrace(Trace& trace, const std::wstring& path, const std::wstring& pid, const std::string& cwd)
+{
+    trace.path = toolPath(path, cwd);
+    trace.pid = narrow(pid);
+    if (trace.pid.empty() || trace.pid.find_first_not_of("0123456789") != std::string::npos)
+        trace.pid = std::to_string(GetCurrentProcessId());
+}
+
+// Appends the line to the file with a single write, which keeps the lines
+// of concurrent writers apart.
+static void appendLine(const std::wstring& path, const std::string& line)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), FILE_APPEND_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        DWORD dwWritten;
+        WriteFile(hFile, line.data(), (DWORD) line.size(), &dwWritten, nullptr);
+        CloseHandle(hFile);
+    }
+}
+
+static std::string jsonString(const std::string& str)
+{
+    std::string json = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            json += '\\';
+        json += c;
+    }
+    return json + "\"";
+}
+
+// Adds a span from start until now to the trace, if any.
+static void traceSpan(const Trace* trace, const std::string& name, ULONGLONG start)
+{
+    if (!trace)
+        return;
+    appendLine(trace->path, "{\"name\":" + jsonString(name) + ",\"cat\":\"msvctricks\",\"ph\":\"X\""
+        + ",\"ts\":" + std::to_string(start) + ",\"dur\":" + std::to_string(traceNow() - start)
+        + ",\"pid\":" + trace->pid + ",\"tid\":" + trace->pid + "}\n");
+}
+
+// Remaps a @file argument the way cmaketricks does it for wine-msvc.sh, but
+// right here, saving a wine process launch per command file. Relative paths
+// are relative to cwd, if given.
+static void remapCommandFile(const Context& ctx, Remapper& remapper, const std::wstring& arg, const std::string& cwd)
+{
+    if (arg.size() < 2 || arg[0] != L'@')
+        return;
+
+    ULONGLONG start = traceNow();
+    std::string path = narrow(arg.substr(1));
+    if (path[0] != '/' && !cwd.empty())
+        path = cwd + "/" + path;
+
+    std::string file = path;
+    if (path[0] == '/')
+    {
+        const std::string* dos = remapper.dosPath(path.data(), path.size());
+        if (dos)
+            file = *dos;
+    }
+
+    if (remapper.remapFile(file.c_str(), Remapper::Mode::CMD) != Remapper::OK)
+    {
+        // Carry on like the wrapper did when cmaketricks failed; the tool
+        // will complain about whatever it can't find.
+        std::string msg = "msvctricks: " + remapper.error() + "\n";
+        DWORD dwWritten;
+        WriteFile(ctx.hStdErr, msg.data(), (DWORD) msg.size(), &dwWritten, nullptr);
+    }
+    traceSpan(ctx.trace, "remap " + narrow(PathFindFileNameW(arg.c_str() + 1)), start);
+}
+
+// Appends a line of JSON with the resources a tool invocation used to the
+// file WINE_MSVC_STATS names. The arguments are only included as a hash, to
+// tell the invocations apart. The file is opened for appending, so that the
+// lines of tools running at the same time don't get mixed up.
+static void writeStats(const std::wstring& path, const std::vector<std::wstring>& args, DWORD dwExitCode, const Stats& stats)
+{
+    // FNV-1a
+    ULONGLONG hash = 14695981039346656037ull;
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        for (wchar_t c : args[i])
+            hash = (hash ^ c) * 1099511628211ull;
+        hash = (hash ^ L'\0') * 1099511628211ull;
+    }
+    char hex[17];
+    wsprintfA(hex, "%08x%08x", (UINT) (hash >> 32), (UINT) hash);
+
+    std::string line = "{\"tool\":" + jsonString(narrow(PathFindFileNameW(args[0].c_str())))
+        + ",\"args\":\"" + hex + "\""
+        + ",\"exit\":" + std::to_string(dwExitCode)
+        + ",\"wall_ms\":" + std::to_string(stats.wallTime / 10000)
+        + ",\"user_ms\":" + std::to_string(stats.userTime / 10000)
+        + ",\"kernel_ms\":" + std::to_string(stats.kernelTime / 10000)
+        + ",\"peak_memory\":" + std::to_string(stats.peakMemory)
+        + ",\"read_bytes\":" + std::to_string(stats.readBytes)
+        + ",\"write_bytes\":" + std::to_string(stats.writeBytes) + "}\n";
+    appendLine(path, line);
+}
+
+// Escapes a file name for a makefile rule, like gcc does.
+static std::string makeEscape(const std::string& file)
+{
+    std::string ret;
+    for (char c : file)
+    {
+        if (c == ' ' || c == '#')
+            ret += '\\';
+        else if (c == '$')
+            ret += '$';
+        ret += c;
+    }
+    return ret;
+}
+
+// Writes the rule "target: files..." of a successful compile.
+static void writeDepfile(const Deps& deps)
+{
+    std::string rule = makeEscape(deps.target) + ":";
+    for (const std::string& file : deps.files)
+        rule += " \\\n  " + makeEscape(file);
+    rule += "\n";
+
+    HANDLE h = CreateFileW(deps.path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+    DWORD dwWritten;
+    WriteFile(h, rule.data(), (DWORD) rule.size(), &dwWritten, nullptr);
+    CloseHandle(h);
+}
+
+static bool isVar(const std::wstring& entry, const std::wstring& name)
+{
+    return entry.size() > name.size() && entry[name.size()] == L'='
+        && _wcsnicmp(entry.c_str(), name.c_str(), name.size()) == 0;
+}
+
+// A compile job, as written by wine-msvc.sh into a file of NUL separated
+// fields: the working directory, the stdout, stderr and status FIFOs, the
+// NAME=VALUE environment overrides terminated by an empty field, and
+// finally the command line arguments.
+struct Job
+{
+    std::string cwd;
+    std::string stdoutPath;
+    std::string stderrPath;
+    std::string statusPath;
+    std::string exe;
+    std::vector<std::wstring> env;
+    std::vector<std::wstring> args;
+
+    bool parse(const std::string& data)
+    {
+        std::vector<std::string> fields;
+        for (size_t pos = 0; pos < data.size(); )
+        {
+            size_t end = data.find('\0', pos);
+            if (end == std::string::npos)
+                end = data.size();
+            fields.emplace_back(data, pos, end - pos);
+            pos = end + 1;
+        }
+        if (fields.size() < 6)
+            return false;
+
+        cwd        = fields[0];
+        stdoutPath = fields[1];
+        stderrPath = fields[2];
+        statusPath = fields[3];
+
+        size_t i = 4;
+        for (; i < fields.size() && !fields[i].empty(); ++i)
+            env.push_back(widen(fields[i]));
+        if (++i >= fields.size())
+            return false;
+
+        exe = fields[i];
+        for (; i < fields.size(); ++i)
+            args.push_back(widen(fields[i]));
+
+        return true;
+    }
+
+    // The value of a variable the job sets
+    std::wstring var(const std::wstring& name) const
+    {
+        for (const std::wstring& entry : env)
+        {
+            if (isVar(entry, name))
+                return entry.substr(name.size() + 1);
+        }
+        return std::wstring();
+    }
+
+    // The environment of the server, with the variables of the job applied
+    // on top. WINEPATH is prepended to PATH, just like wine does it when
+    // starting a new process.
+    std::wstring environment() const
+    {
+        std::vector<std::wstring> vars;
+        if (LPWCH lpEnv = GetEnvironmentStringsW())
+        {
+            for (LPWCH p = lpEnv; *p; p += wcslen(p) + 1)
+                vars.emplace_back(p);
+            FreeEnvironmentStringsW(lpEnv);
+        }
+
+        for (const std::wstring& entry : env)
+        {
+            const std::wstring name = entry.substr(0, entry.find(L'='));
+            for (auto it = vars.begin(); it != vars.end(); )
+                it = isVar(*it, name) ? vars.erase(it) : it + 1;
+            vars.push_back(entry);
+
+            if (_wcsicmp(name.c_str(), L"WINEPATH") == 0)
+            {
+                const std::wstring winepath = entry.substr(name.size() + 1);
+                for (std::wstring& var : vars)
+                {
+                    if (isVar(var, L"PATH"))
+                        var.insert(5, winepath + L";");
+                }
+            }
+        }
+
+        std::wstring block;
+        for (const std::wstring& var : vars)
+        {
+            block += var;
+            block += L'\0';
+        }
+        block += L'\0';
+        return block;
+    }
+};
+
+// Opens a file of a job. The handle isn't inheritable, so that the tools of
+// other jobs don't get it; run() lets only the tool of the job inherit it.
+static HANDLE openOutput(const std::string& path)
+{
+    return CreateFileW(dosPath(path).c_str(), GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+
+static volatile LONG g_activeJobs = 0;
+
+static DWORD WINAPI serveJob(LPVOID lpParam)
+{
+    std::string* jobFile = static_cast<std::string*>(lpParam);
+    ULONGLONG jobStart = traceNow();
+
+    Job job;
+    std::string data;
+    DWORD dwExitCode = ERROR_BAD_FORMAT;
+    bool read = readFile(dosPath(*jobFile), data);
+    // Tells the client that the job was picked up (see wine-msvc.sh).
+    DeleteFileW(dosPath(*jobFile).c_str());
+    if (read && job.parse(data))
+    {
+        std::wstring cmdline;
+        appendArg(cmdline, dosPath(job.exe));
+        for (size_t i = 1; i < job.args.size(); ++i)
+            appendArg(cmdline, job.args[i]);
+
+        std::wstring env = job.environment();
+        std::wstring cwd = dosPath(job.cwd);
+
+        Limits limits;
+        limits.read([&job](LPCWSTR name) { return job.var(name); });
+
+        Context ctx;
+        ctx.hStdIn = GetStdHandle(STD_INPUT_HANDLE);
+        ctx.hStdOut = openOutput(job.stdoutPath);
+        ctx.hStdErr = openOutput(job.stderrPath);
+        // The tool's output must not go anywhere else.
+        bool opened = ctx.hStdOut != INVALID_HANDLE_VALUE && ctx.hStdErr != INVALID_HANDLE_VALUE;
+        ctx.hJob = createChildJob(limits);
+        ctx.dwPriorityClass = limits.priorityClass;
+        ctx.lpEnvironment = &env[0];
+        ctx.lpCurrentDirectory = cwd.c_str();
+
+        Deps deps;
+        std::wstring depfile = job.var(L"WINE_MSVC_DEPFILE");
+        if (!depfile.empty())
+        {
+            deps.path = toolPath(depfile, job.cwd);
+            deps.target = narrow(job.var(L"WINE_MSVC_DEPFILE_TARGET"));
+            deps.keepNotes = !job.var(L"WINE_MSVC_DEPFILE_NOTES").empty();
+        }
+
+        Output out, err;
+        filterOutput(ctx.hStdOut, ctx.out, out, job.var(L"WINE_MSVC_STDOUT_FILTER"), depfile.empty() ? nullptr : &deps);
+        filterOutput(ctx.hStdErr, ctx.err, err, job.var(L"WINE_MSVC_STDERR_FILTER"));
+
+        Stats stats;
+        std::wstring statsPath = job.var(L"WINE_MSVC_STATS");
+        if (!statsPath.empty())
+            ctx.stats = &stats;
+
+        Trace trace;
+        std::wstring tracePath = job.var(L"WINE_MSVC_TRACE");
+        if (!tracePath.empty())
+        {
+            openTrace(trace, tracePath, job.var(L"WINE_MSVC_TRACE_PID"), job.cwd);
+            ctx.trace = &trace;
+        }
+
+        Remapper remapper;
+        for (size_t i = 1; i < job.args.size(); ++i)
+            remapCommandFile(ctx, remapper, job.args[i], job.cwd);
+
+        ULONGLONG start = traceNow();
+        HANDLE hSlot = acquireHeavySlot(limits, job.args[0].c_str());
+        if (hSlot)
+            traceSpan(ctx.trace, "heavy slot", start);
+        start = traceNow();
+        dwExitCode = opened ? tool(ctx, job.args[0].c_str(), &cmdline[0]) : ERROR_OPEN_FAILED;
+        traceSpan(ctx.trace, narrow(PathFindFileNameW(job.args[0].c_str())), start);
+        releaseHeavySlot(hSlot);
+
+        std::wstring fixup = job.var(L"WINE_MSVC_FIXUP_LINE");
+        if (dwExitCode == 0 && !fixup.empty())
+        {
+            start = traceNow();
+            dwExitCode = fixupLines(toolPath(fixup, job.cwd), ctx.err ? ctx.err->hTarget : ctx.hStdErr);
+            traceSpan(ctx.trace, "fixup", start);
+        }
+
+        if (dwExitCode == 0 && !depfile.empty())
+            writeDepfile(deps);
+
+        if (ctx.stats)
+            writeStats(toolPath(statsPath, job.cwd), job.args, dwExitCode, stats);
+
+        traceSpan(ctx.trace, "job", jobStart);
+
+        if (ctx.hJob)
+            CloseHandle(ctx.hJob);
+        for (HANDLE h : { out.hTarget, err.hTarget })
+        {
+            if (h != INVALID_HANDLE_VALUE)
+                CloseHandle(h);
+        }
+        if (!ctx.out && ctx.hStdOut != INVALID_HANDLE_VALUE)
+            CloseHandle(ctx.hStdOut);
+        if (!ctx.err && ctx.hStdErr != INVALID_HANDLE_VALUE)
+            CloseHandle(ctx.hStdErr);
+    }
+
+    // The client blocks on reading the status FIFO, so always report back,
+    // even if the job couldn't be started at all.
+    if (!job.statusPath.empty())
+    {
+        HANDLE hStatus = openOutput(job.statusPath);
+        if (hStatus != INVALID_HANDLE_VALUE)
+        {
+            char buf[16];
+            int len = wsprintfA(buf, "%lu\n", dwExitCode);
+            DWORD dwWritten;
+            WriteFile(hStatus, buf, len, &dwWritten, nullptr);
+            CloseHandle(hStatus);
+        }
+    }
+
+    delete jobFile;
+    InterlockedDecrement(&g_activeJobs);
+    return 0;
+}
+
+// Keeps running in the background and picks up jobs from <dir>/jobs, a FIFO
+// which wine-msvc.sh writes the path of a job file to, one per line. This
+// saves the startup cost of a new wine process for every tool invocation.
+static int serve(LPCWSTR dir)
+{
+    std::string jobs;
+    jobs.resize(WideCharToMultiByte(CP_UNIXCP, 0, dir, -1, nullptr, 0, nullptr, nullptr));
+    WideCharToMultiByte(CP_UNIXCP, 0, dir, -1, &jobs[0], (int) jobs.size(), nullptr, nullptr);
+    jobs.resize(jobs.size() - 1);
+    jobs += "/jobs";
+
+    // Open the FIFO for writing as well, so that reading it never hits EOF
+    // when the last client is done with it.
+    HANDLE hJobs = CreateFileW(dosPath(jobs).c_str(), GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hJobs == INVALID_HANDLE_VALUE)
+        return GetLastError();
+
+    std::string line;
+    char buf[4096];
+    DWORD dwRead;
+    bool quit = false;
+    while (!quit && ReadFile(hJobs, buf, sizeof(buf), &dwRead, nullptr) && dwRead > 0)
+    {
+        line.append(buf, dwRead);
+
+        size_t pos;
+        while (!quit && (pos = line.find('\n')) != std::string::npos)
+        {
+            std::string* jobFile = new std::string(line, 0, pos);
+            line.erase(0, pos + 1);
+
+            if (*jobFile == "quit")
+            {
+                delete jobFile;
+                quit = true;
+                break;
+            }
+
+            InterlockedIncrement(&g_activeJobs);
+            HANDLE hThread = CreateThread(nullptr, 0, serveJob, jobFile, 0, nullptr);
+            if (hThread)
+            {
+                CloseHandle(hThread);
+            }
+            else
+            {
+                delete jobFile;
+                InterlockedDecrement(&g_activeJobs);
+            }
+        }
+    }
+
+    while (g_activeJobs > 0)
+        Sleep(10);
+
+    CloseHandle(hJobs);
+    return 0;
+}
+
+// Says that the file for the output of the tool couldn't be opened, on
+// stderr (which the wrapper leaves alone for this), and returns the error.
+static DWORD openFailed(LPCWSTR path)
+{
+    DWORD dwError = GetLastError();
+    char code[16];
+    wsprintfA(code, "%lu", dwError);
+    std::string msg = "msvctricks: can't open " + narrow(path) + ": error " + code + "\n";
+    DWORD dwWritten;
+    WriteFile(GetStdHandle(STD_ERROR_HANDLE), msg.data(), (DWORD) msg.size(), &dwWritten, nullptr);
+    return dwError;
+}
+
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
     (void) hInstance;
     (void) hPrevInstance;
     (void) nCmdShow;
+    ULONGLONG mainStart = traceNow();
 
     int argc = 0;
     wchar_t** argv = CommandLineToArgvW(lpCmdLine, &argc);
     if (argc <= 0) return 0;
 
+    if (argc == 2 && wcscmp(argv[0], L"--serve") == 0)
+        return serve(argv[1]);
+
+    Context ctx;
+
     wchar_t buf[32768];
     if (GetEnvironmentVariableW(L"WINE_MSVC_STDIN", buf, ARRAYSIZE(buf)))
     {
@@ -92,7 +1490,7 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         attr.nLength = sizeof(attr);
         attr.bInheritHandle = TRUE;
 
-        hStdIn = CreateFileW(buf, GENERIC_READ,
+        ctx.hStdIn = CreateFileW(buf, GENERIC_READ,
             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
             &attr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
     }
@@ -102,9 +1500,13 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         attr.nLength = sizeof(attr);
         attr.bInheritHandle = TRUE;
 
-        hStdOut = CreateFileW(buf, GENERIC_WRITE,
+        ctx.hStdOut = CreateFileW(buf, GENERIC_WRITE,
             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
             &attr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        // The wrapper points our own standard handles at /dev/null, so
+        // falling back to them would lose the output.
+        if (ctx.hStdOut == INVALID_HANDLE_VALUE)
+            return openFailed(buf);
     }
     if (GetEnvironmentVariableW(L"WINE_MSVC_STDERR", buf, ARRAYSIZE(buf)))
     {
@@ -112,36 +1514,98 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         attr.nLength = sizeof(attr);
         attr.bInheritHandle = TRUE;
 
-        hStdErr = CreateFileW(buf, GENERIC_WRITE,
+        ctx.hStdErr = CreateFileW(buf, GENERIC_WRITE,
             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
             &attr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        // The wrapper points our own standard handles at /dev/null, so
+        // falling back to them would lose the output.
+        if (ctx.hStdErr == INVALID_HANDLE_VALUE)
+            return openFailed(buf);
     }
 
-    if (hStdIn == INVALID_HANDLE_VALUE)
+    if (ctx.hStdIn == INVALID_HANDLE_VALUE)
     {
-        hStdIn = GetStdHandle(STD_INPUT_HANDLE);
+        ctx.hStdIn = GetStdHandle(STD_INPUT_HANDLE);
     }
-    if (hStdOut == INVALID_HANDLE_VALUE)
+    if (ctx.hStdOut == INVALID_HANDLE_VALUE)
     {
-        hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
+        ctx.hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
     }
-    if (hStdErr == INVALID_HANDLE_VALUE)
+    if (ctx.hStdErr == INVALID_HANDLE_VALUE)
     {
-        hStdErr = GetStdHandle(STD_ERROR_HANDLE);
+        ctx.hStdErr = GetStdHandle(STD_ERROR_HANDLE);
     }
 
-    if (hChildJob = CreateJobObjectW(nullptr, nullptr))
+    Limits limits;
+    limits.read([&buf](LPCWSTR name) {
+        return GetEnvironmentVariableW(name, buf, ARRAYSIZE(buf)) ? std::wstring(buf) : std::wstring();
+    });
+    ctx.hJob = createChildJob(limits);
+    ctx.dwPriorityClass = limits.priorityClass;
+
+    Deps deps;
+    if (GetEnvironmentVariableW(L"WINE_MSVC_DEPFILE", buf, ARRAYSIZE(buf)))
     {
-        JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = {};
-        info.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE
-                                              | JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
-        SetInformationJobObject(hChildJob, JobObjectExtendedLimitInformation, &info, sizeof(info));
+        deps.path = toolPath(buf, std::string());
+        if (GetEnvironmentVariableW(L"WINE_MSVC_DEPFILE_TARGET", buf, ARRAYSIZE(buf)))
+            deps.target = narrow(buf);
+        deps.keepNotes = GetEnvironmentVariableW(L"WINE_MSVC_DEPFILE_NOTES", buf, ARRAYSIZE(buf)) > 0;
     }
 
-    LPCWSTR const exe = PathFindFileNameW(argv[0]);
+    Output out, err;
+    std::wstring filters;
+    if (GetEnvironmentVariableW(L"WINE_MSVC_STDOUT_FILTER", buf, ARRAYSIZE(buf)))
+        filters = buf;
+    filterOutput(ctx.hStdOut, ctx.out, out, filters, deps.path.empty() ? nullptr : &deps);
+    if (GetEnvironmentVariableW(L"WINE_MSVC_STDERR_FILTER", buf, ARRAYSIZE(buf)))
+        filterOutput(ctx.hStdErr, ctx.err, err, buf);
 
-    if (PathMatchSpecW(exe, L"mt.exe"))
-        return mt(lpCmdLine);
+    Stats stats;
+    std::wstring statsPath;
+    if (GetEnvironmentVariableW(L"WINE_MSVC_STATS", buf, ARRAYSIZE(buf)))
+    {
+        statsPath = toolPath(buf, std::string());
+        ctx.stats = &stats;
+    }
+
+    Trace trace;
+    if (GetEnvironmentVariableW(L"WINE_MSVC_TRACE", buf, ARRAYSIZE(buf)))
+    {
+        std::wstring tracePath = buf;
+        std::wstring pid;
+        if (GetEnvironmentVariableW(L"WINE_MSVC_TRACE_PID", buf, ARRAYSIZE(buf)))
+            pid = buf;
+        openTrace(trace, tracePath, pid, std::string());
+        ctx.trace = &trace;
+    }
 
-    return run(lpCmdLine);
+    Remapper remapper;
+    for (int i = 1; i < argc; ++i)
+        remapCommandFile(ctx, remapper, argv[i], std::string());
+
+    ULONGLONG start = traceNow();
+    HANDLE hSlot = acquireHeavySlot(limits, argv[0]);
+    if (hSlot)
+        traceSpan(ctx.trace, "heavy slot", start);
+    start = traceNow();
+    DWORD dwExitCode = tool(ctx, argv[0], lpCmdLine);
+    traceSpan(ctx.trace, narrow(PathFindFileNameW(argv[0])), start);
+    releaseHeavySlot(hSlot);
+
+    if (dwExitCode == 0 && GetEnvironmentVariableW(L"WINE_MSVC_FIXUP_LINE", buf, ARRAYSIZE(buf)))
+    {
+        start = traceNow();
+        dwExitCode = fixupLines(toolPath(buf, std::string()), ctx.err ? ctx.err->hTarget : ctx.hStdErr);
+        traceSpan(ctx.trace, "fixup", start);
+    }
+
+    if (dwExitCode == 0 && !deps.path.empty())
+        writeDepfile(deps);
+
+    if (ctx.stats)
+        writeStats(statsPath, std::vector<std::wstring>(argv, argv + argc), dwExitCode, stats);
+
+    traceSpan(ctx.trace, "msvctricks", mainStart);
+
+    return dwExitCode;
 }
@@ -0,0 +1,69 @@
+// Compares the token classifier of cmaketricks against the std::regex based
+// classification it replaced, both for equal results and for speed, over
+// the tokens of the given command files.
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <regex>
+#include <string>
+#include <vector>
+#include "../cmaketricks.h"
+
+static const std::regex JUS_PATH{ "\\/.+\\/.+" };                // /absolute/path
+static const std::regex ONE_PATH{ "[-\\/][A-Za-z]\\/.*" };       // -I/absolute/path /I/absolute/path
+static const std::regex DUO_PATH{ "[-\\/][A-Za-z]{2}\\/.*" };    // -Fo/absolute/path /Fo/absolute/path
+static const std::regex TRI_PATH{ "[-\\/][A-Za-z]{3,}:\\/.*" };  // -MANIFESTINPUT:/absolute/path /MANIFESTINPUT:/absolute/path
+
+static PathKind classifyRegex( const char* pToken ) {
+  if ( std::regex_match( pToken, ONE_PATH ) )
+    return PathKind::ONE;
+  if ( std::regex_match( pToken, DUO_PATH ) )
+    return PathKind::DUO;
+  if ( std::regex_match( pToken, TRI_PATH ) )
+    return PathKind::TRI;
+  if ( std::regex_match( pToken, JUS_PATH ) )
+    return PathKind::JUS;
+  return PathKind::NONE;
+}
+
+template<typename Classify>
+static double measure( const std::vector<std::string>& pTokens, int pRounds, Classify pClassify, unsigned& pSum ) {
+  const auto start = std::chrono::steady_clock::now();
+  for ( int round = 0; round < pRounds; round += 1 )
+    for ( const auto& tok : pTokens )
+      pSum += static_cast<unsigned>( pClassify( tok.c_str() ) );
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>( end - start ).count() / pRounds;
+}
+
+int main( int argc, char** argv ) {
+  if ( argc < 2 ) {
+    fputs( "usage: bench-cmaketricks [file(s)]\n", stderr );
+    return 1;
+  }
+
+  std::vector<std::string> tokens;
+  for ( int i = 1; i < argc; i += 1 ) {
+    std::ifstream file{ argv[i] };
+    tokens.insert( tokens.end(), std::istream_iterator<std::string>{ file }, std::istream_iterator<std::string>{} );
+  }
+
+  int mismatches = 0;
+  for ( const auto& tok : tokens ) {
+    if ( classify( tok.c_str() ) != classifyRegex( tok.c_str() ) ) {
+      fprintf( stderr, "mismatch: `%s`\n", tok.c_str() );
+      mismatches += 1;
+    }
+  }
+
+  unsigned sum = 0;
+  const auto regexMs = measure( tokens, 3, classifyRegex, sum );
+  const auto tableMs = measure( tokens, 30, []( const char* pToken ) { return classify( pToken ); }, sum );
+  printf( "tokens:     %zu\n", tokens.size() );
+  printf( "std::regex: %.3f ms\n", regexMs );
+  printf( "classify:   %.3f ms\n", tableMs );
+  printf( "speedup:    %.1fx\n", regexMs / tableMs );
+  return (mismatches == 0 && sum != 0) ? 0 : 1;
+}
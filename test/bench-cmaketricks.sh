@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Usage: BIN=/opt/msvc/bin/x64/ test/bench-cmaketricks.sh [objects]
+
+. "${0%/*}/test.sh"
+
+WINE=$(command -v wine64 || command -v wine || false)
+export WINEDEBUG=${WINEDEBUG:-"-all"}
+OBJECTS=${1:-20000}
+
+
+# A command file like CMake generates for linking a big target.
+{
+    echo "/nologo /machine:x64 /debug /INCREMENTAL:NO /subsystem:console"
+    for i in $(seq $OBJECTS); do
+        echo "${CWD}CMakeFiles/big.dir/src/dir$(($i % 100))/file$i.cpp.obj"
+    done
+    echo "-LIBPATH:${CWD}lib /out:${CWD}big.exe /implib:${CWD}big.lib /pdb:${CWD}big.pdb"
+    echo "-MANIFESTINPUT:${CWD}big.manifest kernel32.lib user32.lib"
+} >link.rsp
+
+EXEC "" ${BIN}cl /nologo /EHsc /O2 ${TESTS}bench-cmaketricks.cpp
+EXEC "" $WINE bench-cmaketricks.exe link.rsp
+
+
+EXIT
@@ -0,0 +1,117 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Measures the overhead of the wrappers per tool invocation, for comparing
+# changes (or e.g. running with and without WINE_MSVC_SERVER) on the same
+# machine. Prints the median and 95th percentile of the wall clock of each
+# case, and how many of them run per hour one after another. Then builds a
+# generated CMake project with many translation units, linked through large
+# response files, and prints how many such builds run per hour.
+#
+# Usage: BIN=/opt/msvc/bin/x64/ test/bench.sh [runs] [sources]
+
+. "${0%/*}/test.sh"
+
+RUNS=${1:-20}
+SOURCES=${2:-2000}
+
+if [ -z "$EPOCHREALTIME" ]; then
+    echo "$NAME needs bash 5 for EPOCHREALTIME" >&2
+    exit 1
+fi
+
+# Prints the current time in microseconds.
+now() {
+    echo ${EPOCHREALTIME/[.,]/}
+}
+
+# Prints microseconds as milliseconds.
+ms() {
+    printf "%d.%d" $(($1 / 1000)) $(($1 / 100 % 10))
+}
+
+# Prints how many times something taking $1 microseconds runs per hour.
+per_hour() {
+    echo $((3600000000 / ($1 > 0 ? $1 : 1)))
+}
+
+# Runs the command RUNS times after a first, untimed one (which checks that
+# it works at all and warms up wine and the page cache), and prints the
+# median and the 95th percentile of the runs.
+bench() {
+    local name=$1 i start times=()
+    shift
+    EXEC "" "$@" >/dev/null || return
+    for i in $(seq $RUNS); do
+        start=$(now)
+        if ! "$@" >/dev/null 2>&1; then
+            EXEC "" false
+            return
+        fi
+        times+=($(($(now) - start)))
+    done
+    times=($(printf '%s\n' "${times[@]}" | sort -n))
+
+    local n=${#times[@]}
+    local median=${times[$(($n / 2))]}
+    local p95=${times[$((($n * 95 + 99) / 100 - 1))]}
+    printf "%-16s %4d runs   median %8s ms   p95 %8s ms   %8d/hour\n" \
+        "$name" $n $(ms $median) $(ms $p95) $(per_hour $median)
+}
+
+
+cp "${TESTS}hello.c" "${TESTS}headers.cpp" "${TESTS}hello.rc" "${TESTS}utf8.manifest" .
+
+bench cl-hello      ${BIN}cl /nologo /c hello.c
+bench cl-headers    ${BIN}cl /nologo /EHsc /c headers.cpp
+bench link          ${BIN}link /nologo hello.obj /out:hello.exe
+bench lib           ${BIN}lib /nologo hello.obj /out:hello.lib
+bench rc            ${BIN}rc /nologo hello.rc
+
+
+# A static library of SOURCES translation units and an executable linking
+# all of them, with the command lines of lib and link in response files.
+mkdir -p project/src
+for i in $(seq $SOURCES); do
+    echo "int func$i(int x) { return x + $i; }" >project/src/file$i.c
+done
+echo "int main(void) { return 0; }" >project/main.c
+{
+    echo "cmake_minimum_required(VERSION 3.13)"
+    echo "project(bench C)"
+    echo "file(GLOB sources src/*.c)"
+    echo "add_library(bench STATIC \${sources})"
+    echo "add_executable(main main.c)"
+    echo "target_link_libraries(main bench)"
+    echo "target_link_options(main PRIVATE /WHOLEARCHIVE:bench)"
+} >project/CMakeLists.txt
+
+CMAKE_ARGS=(
+    -DCMAKE_BUILD_TYPE=Release
+    -DCMAKE_SYSTEM_NAME=Windows
+    -DCMAKE_NINJA_FORCE_RESPONSE_FILE=ON
+)
+
+if EXEC "" CC=${BIN}cl cmake -Sproject -Bbuild -GNinja "${CMAKE_ARGS[@]}" >/dev/null; then
+    start=$(now)
+    EXEC "" ninja -C build >/dev/null
+    t=$(($(now) - start))
+    printf "%-16s %4d TUs    total %9s ms   per TU %5s ms   %8d builds/hour\n" \
+        cmake-project $(($SOURCES + 1)) $(ms $t) $(ms $(($t / ($SOURCES + 1)))) $(per_hour $t)
+fi
+
+
+EXIT
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+. "${0%/*}/test.sh"
+
+fails() {
+    eval $(printf '%q ' "$@")
+    [ $? -ne 0 ]
+}
+
+export WINE_MSVC_BATCH="${CWD}batch"
+# Long enough for all the compiles below to join the same batch.
+export WINE_MSVC_BATCH_WINDOW=2000
+export WINE_MSVC_BATCH_SIZE=8
+# Every time cl.exe actually runs, msvctricks adds a line to this file.
+export WINE_MSVC_STATS="${CWD}stats"
+
+
+for i in 1 2 3; do
+    echo "int value$i = $i;" >test$i.c
+done
+cat >error.c <<EOF
+#error expected
+EOF
+
+
+mkdir obj
+${BIN}cl /nologo /c test1.c >cl-batch1.out & pid1=$!
+${BIN}cl /nologo /c test2.c /Fotest2-renamed.obj >cl-batch2.out & pid2=$!
+${BIN}cl /nologo /c test3.c /Foobj/ >cl-batch3.out & pid3=$!
+${BIN}cl /nologo /c error.c >cl-batch-error.out & pid4=$!
+EXEC "" wait $pid1
+EXEC "" wait $pid2
+EXEC "" wait $pid3
+EXEC "" fails wait $pid4
+
+DIFF cl-batch1.out - <<EOF
+test1.c
+EOF
+DIFF cl-batch2.out - <<EOF
+test2.c
+EOF
+EXEC "" test -f test1.obj
+EXEC "" test -f test2-renamed.obj
+EXEC "" test -f obj/test3.obj
+EXEC "" test ! -f error.obj
+
+# Compiles with different options go into different batches.
+EXEC cl-batch-other ${BIN}cl /nologo /DVALUE=1 /c test1.c /Fotest1-other.obj
+EXEC "" test -f test1-other.obj
+
+if [ -f "${BIN}../msvctricks.exe" ]; then
+    wc -l <stats | tr -d ' ' >stats.count
+    DIFF stats.count - <<EOF
+2
+EOF
+fi
+
+
+EXIT
@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+. "${0%/*}/test.sh"
+
+export WINE_MSVC_CACHE="${CWD}cache"
+# Every time cl.exe actually runs, msvctricks adds a line to this file.
+export WINE_MSVC_STATS="${CWD}stats"
+
+
+cat >test.h <<EOF
+#define VALUE 1
+EOF
+
+cat >test.c <<EOF
+#include "test.h"
+int value = VALUE;
+EOF
+
+
+EXEC cl-miss ${BIN}cl /nologo /c test.c
+DIFF cl-miss.out - <<EOF
+test.c
+EOF
+EXEC "" rm test.obj
+
+# A hit restores the object and replays the output, without running cl.exe.
+EXEC cl-hit ${BIN}cl /nologo /c test.c
+DIFF cl-hit.out cl-miss.out
+EXEC "" test -f test.obj
+
+EXEC cl-showIncludes ${BIN}cl /nologo /showIncludes /c test.c
+DIFF cl-showIncludes.out - <<EOF
+test.c
+Note: including file: ${CWD}test.h
+EOF
+
+# Changing a header makes it miss again.
+cat >test.h <<EOF
+#define VALUE 2
+EOF
+EXEC cl-header ${BIN}cl /nologo /c test.c
+
+# Compiles with separate PDB files aren't cached.
+EXEC cl-Zi ${BIN}cl /nologo /Zi /c test.c
+EXEC cl-Zi ${BIN}cl /nologo /Zi /c test.c
+
+if [ -f "${BIN}../msvctricks.exe" ]; then
+    wc -l <stats | tr -d ' ' >stats.count
+    DIFF stats.count - <<EOF
+4
+EOF
+fi
+
+
+EXIT
@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+. "${0%/*}/test.sh"
+
+fails() {
+    eval $(printf '%q ' "$@")
+    [ $? -ne 0 ]
+}
+
+# Instead of ssh, run the worker on this host, from a different directory.
+cat >remote <<EOF
+#!/bin/bash
+shift
+cd /
+exec bash -c "\$*"
+EOF
+chmod +x remote
+
+export WINE_MSVC_DIST_HOSTS=localhost
+export WINE_MSVC_DIST_SSH="${CWD}remote"
+export WINE_MSVC_DIST_SERVER="${CWD}server"
+
+
+cat >test.h <<EOF
+#define VALUE 1
+EOF
+
+cat >test.c <<EOF
+#include "test.h"
+int value = VALUE;
+EOF
+
+
+EXEC cl-dist ${BIN}cl /nologo /showIncludes /c test.c
+DIFF cl-dist.out - <<EOF
+test.c
+Note: including file: ${CWD}test.h
+EOF
+EXEC "" test -f test.obj
+
+EXEC cl-dist-Fo ${BIN}cl /nologo -DVALUE2=2 /c test.c -Fotest2.obj
+EXEC "" test -f test2.obj
+
+# Errors of the remote compile are reported as usual.
+cat >error.c <<EOF
+#error expected
+EOF
+EXEC cl-dist-error fails ${BIN}cl /nologo /c error.c
+
+# If the host can't be reached, it's compiled locally.
+EXEC cl-local env WINE_MSVC_DIST_SSH=false ${BIN}cl /nologo /c test.c -Fotest3.obj
+DIFF cl-local.out - <<EOF
+test.c
+EOF
+EXEC "" test -f test3.obj
+
+EXEC "" ${BIN}wine-msvc-server.sh stop "$WINE_MSVC_DIST_SERVER"
+
+
+EXIT
@@ -37,6 +37,25 @@ Note: including file: ${CWD}test.h
 EOF
 
 
+# Output into a pipe is filtered by msvctricks and written there directly.
+EXEC cl-showIncludes-pipe bash -c "${BIN}cl /nologo /showIncludes /c test.c | cat"
+DIFF cl-showIncludes-pipe.out - <<EOF
+test.c
+Note: including file: ${CWD}test.h
+EOF
+
+
+# The notes go into the depfile instead, with or without msvctricks.
+EXEC cl-depfile env WINE_MSVC_DEPFILE=test.d ${BIN}cl /nologo /c test.c /Fotest-depfile.obj
+DIFF cl-depfile.out - <<EOF
+test.c
+EOF
+DIFF test.d - <<EOF
+test-depfile.obj: \\
+  ${CWD}test.h
+EOF
+
+
 EXEC cl-showIncludes-E-FC ${BIN}cl /nologo /showIncludes /E /FC test.c
 DIFF cl-showIncludes-E-FC.out - <<EOF
 #line 1 "${CWD}test.c"
@@ -43,4 +43,9 @@ EXEC "" lld-link hello.obj -out:hello.exe
 # test preprocessing it to make sure that all paths can be found.
 EXEC "" clang-cl --target=$TARGET_TRIPLE "${TESTS}headers.cpp" -P -Fiheaders-preproc.cpp
 
+# The same, looking up the headers through the VFS overlay.
+if [ -n "$VFSOVERLAY" ]; then
+    EXEC "" clang-cl --target=$TARGET_TRIPLE $VFSOVERLAY_FLAGS "${TESTS}headers.cpp" -P -Fiheaders-preproc-vfs.cpp
+fi
+
 EXIT
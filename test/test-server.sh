@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+. "${0%/*}/test.sh"
+
+fails() {
+    eval $(printf '%q ' "$@")
+    [ $? -ne 0 ]
+}
+
+
+EXEC server-start ${BIN}wine-msvc-server.sh start "${CWD}server"
+eval "$(cat server-start.out)"
+EXEC "" ${BIN}wine-msvc-server.sh status
+
+
+cat >test.h <<EOF
+EOF
+
+cat >test.c <<EOF
+#include "test.h"
+int main() { return 0; }
+EOF
+
+
+EXEC cl-showIncludes ${BIN}cl /nologo /showIncludes /c test.c
+DIFF cl-showIncludes.out - <<EOF
+test.c
+Note: including file: ${CWD}test.h
+EOF
+
+EXEC "" ${BIN}cl /nologo ${TESTS}hello.c
+
+# The exit code of the tool is passed back to the client.
+cat >error.c <<EOF
+#error expected
+EOF
+EXEC cl-error fails ${BIN}cl /nologo /c error.c
+
+
+EXEC "" ${BIN}wine-msvc-server.sh stop
+EXEC "" fails ${BIN}wine-msvc-server.sh status
+
+
+# Jobs are spread over the shards, each with a prefix of its own.
+EXEC server-shards env WINE_MSVC_SERVER_SHARDS=2 ${BIN}wine-msvc-server.sh start "${CWD}shards"
+eval "$(cat server-shards.out)"
+EXEC "" ${BIN}wine-msvc-server.sh status
+
+EXEC cl-shards bash -c "${BIN}cl /nologo /c test.c /Fotest1.obj & ${BIN}cl /nologo /c test.c /Fotest2.obj & wait"
+EXEC "" test -f test1.obj
+EXEC "" test -f test2.obj
+
+EXEC "" ${BIN}wine-msvc-server.sh stop
+EXEC "" fails test -d "${CWD}shards"
+
+
+# A persistent mspdbsrv.exe serves the PDB writes of all jobs.
+# It needs winbind, which isn't available on macOS.
+if [[ $OSTYPE != darwin* ]]; then
+    EXEC server-mspdbsrv env WINE_MSVC_MSPDBSRV=1 ${BIN}wine-msvc-server.sh start "${CWD}mspdbsrv"
+    eval "$(cat server-mspdbsrv.out)"
+    EXEC "" test -n "$_MSPDBSRV_ENDPOINT_"
+
+    EXEC cl-mspdbsrv bash -c "${BIN}cl /nologo /Zi /FS /Fdvc.pdb /c test.c /Fotest1.obj & ${BIN}cl /nologo /Zi /FS /Fdvc.pdb /c test.c /Fotest2.obj & wait"
+    EXEC "" ${BIN}link /nologo /debug /incremental test1.obj /out:test.exe
+    EXEC "" test -f vc.pdb
+    EXEC "" test -f test.pdb
+
+    EXEC "" ${BIN}wine-msvc-server.sh stop
+    unset _MSPDBSRV_ENDPOINT_
+fi
+
+
+EXIT
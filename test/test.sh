@@ -99,6 +99,10 @@ for arch in x86 x64 arm arm64; do
     EXEC "" BIN=$BIN ./test-mc.sh
     EXEC "" BIN=$BIN ./test-cmake.sh
     EXEC "" BIN=$BIN ./test-meson.sh
+    EXEC "" BIN=$BIN ./test-server.sh
+    EXEC "" BIN=$BIN ./test-cl-cache.sh
+    EXEC "" BIN=$BIN ./test-cl-dist.sh
+    EXEC "" BIN=$BIN ./test-cl-batch.sh
 
     # MSBuild requires .NET framework v4.x or Mono to run.
     # Wine will search for Wine Mono in the following places:
@@ -15,20 +15,37 @@
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 import argparse
+import contextlib
 import functools
 import glob
 import hashlib
 import os
 import multiprocessing.pool
 import json
+import platform
+import re
 import shutil
 import socket
 import subprocess
 import sys
 import tempfile
+import threading
 import urllib.request
 import zipfile
 
+try:
+    import fcntl
+except ImportError:
+    fcntl = None
+
+sdkArchs = ["x86", "x64", "arm", "arm64"]
+
+def defaultHostArch():
+    # Like install.sh, which picks the tools to use
+    if platform.machine().lower() in ["aarch64", "arm64"]:
+        return "arm64"
+    return "x64"
+
 def getArgsParser():
     parser = argparse.ArgumentParser(description = "Download and install Visual Studio")
     parser.add_argument("--manifest", metavar="manifest", help="A predownloaded manifest file")
@@ -36,6 +53,9 @@ def getArgsParser():
     parser.add_argument("--major", default=17, metavar="version", help="The major version to download (defaults to 17)")
     parser.add_argument("--preview", dest="type", default="release", const="pre", action="store_const", help="Download the preview version instead of the release version")
     parser.add_argument("--cache", metavar="dir", help="Directory to use as a persistent cache for downloaded files")
+    parser.add_argument("--mirror", metavar="url|dir", help="URL or shared directory to fetch payloads from by their sha256 before downloading them; new downloads are added to a directory")
+    parser.add_argument("--download-jobs", metavar="jobs", type=int, default=5, help="Number of files to download in parallel (defaults to 5)")
+    parser.add_argument("--unpack-jobs", metavar="jobs", type=int, default=os.cpu_count(), help="Number of packages to unpack in parallel (defaults to the number of CPUs)")
     parser.add_argument("--dest", metavar="dir", help="Directory to install into")
     parser.add_argument("package", metavar="package", help="Package to install. If omitted, installs the default command line tools.", nargs="*")
     parser.add_argument("--ignore", metavar="component", help="Package to skip", action="append")
@@ -54,6 +74,8 @@ def getArgsParser():
     parser.add_argument("--keep-unpack", const=True, action="store_const", help="Keep the unpacked files that aren't otherwise selected as needed output")
     parser.add_argument("--msvc-version", metavar="version", help="Install a specific MSVC toolchain version")
     parser.add_argument("--sdk-version", metavar="version", help="Install a specific Windows SDK version")
+    parser.add_argument("--architecture", metavar="arch[,arch]", default=",".join(sdkArchs), help="Target architectures to install the Windows SDK libraries for, out of " + ", ".join(sdkArchs) + " (defaults to all)")
+    parser.add_argument("--host-arch", metavar="arch", choices=["x64", "arm64"], default=defaultHostArch(), help="Host architecture to install the Windows SDK tools for (defaults to the current one)")
     parser.add_argument("--with-wdk-installers", metavar="dir", help="Install Windows Driver Kit using the provided MSI installers")
     return parser
 
@@ -419,58 +441,368 @@ def getPayloadName(payload):
         name = name.split("/")[-1]
     return name
 
-def downloadPackages(selected, cache, allowHashMismatch = False):
-    pool = multiprocessing.Pool(5)
+def isWinSDK(p):
+    return p["id"].startswith("Win10SDK") or p["id"].startswith("Win11SDK")
+
+# MSIs of the Windows SDK that only have tools which aren't needed for
+# building, matched by their whole name, like
+# "X64 Debuggers And Tools-x64_en-us.msi". Any other MSI is kept.
+sdkUnneededMSIs = re.compile(r"(?:(?:X86|X64|ARM|ARM64) Debuggers And Tools|Application Verifier (?:x86|x64|arm|arm64) External Package(?: \([\w ]+\))?|Windows App Certification Kit[\w ()]*|WinAppDeploy|Windows IP Over USB|Windows Mobile Connectivity Tools|Windows SDK EULA)-(?:x86|x64|arm|arm64)_[a-z]{2}-[a-z]{2}\.msi", re.IGNORECASE)
+# MSIs with the libraries or tools for one architecture, like
+# "Windows SDK Desktop Libs arm64-x86_en-us.msi".
+sdkArchMSI = re.compile(r" (Libs|Tools) (x86|x64|arm|arm64)-", re.IGNORECASE)
+
+def isSDKMSINeeded(name, archs, host, keepAll):
+    if not keepAll and sdkUnneededMSIs.fullmatch(name):
+        return False
+    m = sdkArchMSI.search(name)
+    if m != None:
+        if m.group(1).lower() == "libs":
+            return m.group(2).lower() in archs
+        return m.group(2).lower() == host
+    return True
+
+# The cabinets an MSI extracts its files from, from its Media table.
+def getMSICabinets(msi):
+    try:
+        output = subprocess.check_output(["msiinfo", "export", msi, "Media"], universal_newlines=True)
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    cabs = set()
+    # The first three lines are the column names, types and the table name
+    for line in output.splitlines()[3:]:
+        columns = line.split("\t")
+        if len(columns) > 3 and columns[3] != "" and not columns[3].startswith("#"):
+            cabs.add(columns[3].lower())
+    return cabs
+
+# Drops the payloads of the Windows SDK packages that aren't needed for the
+# given architectures: first the MSIs, and then the cabinets that none of the
+# remaining MSIs refer to. This requires downloading the MSIs up front, to read
+# their Media tables with msiinfo; without it, all cabinets are kept.
+def pruneSDKPayloads(selected, cache, archs, host, keepAll, jobs, mirror):
+    for p in selected:
+        if not isWinSDK(p) or not p.get("payloads"):
+            continue
+        msis = []
+        others = []
+        for payload in p["payloads"]:
+            name = getPayloadName(payload)
+            if not name.lower().endswith(".msi"):
+                others.append(payload)
+            elif isSDKMSINeeded(name, archs, host, keepAll):
+                msis.append(payload)
+            else:
+                print("Skipping %s of %s" % (name, p["id"]), flush=True)
+        needed = msis + others
+        if sys.platform != "win32" and shutil.which("msiinfo") != None:
+            downloadPackages([dict(p, payloads=msis)], cache, jobs=jobs, mirror=mirror)
+            dir = os.path.join(cache, getPackageKey(p))
+            cabs = set()
+            for payload in msis:
+                msiCabs = getMSICabinets(os.path.join(dir, getPayloadName(payload)))
+                if msiCabs == None:
+                    cabs = None
+                    break
+                cabs |= msiCabs
+            if cabs != None:
+                needed = msis + [payload for payload in others if not getPayloadName(payload).lower().endswith(".cab") or getPayloadName(payload).lower() in cabs]
+        skipped = [payload for payload in p["payloads"] if payload not in needed]
+        if len(skipped) > 0:
+            print("Skipping %d of %d payloads (%s) of %s that aren't needed for %s" % (len(skipped), len(p["payloads"]), formatSize(sum(payload.get("size", 0) for payload in skipped)), p["id"], ",".join(archs)), flush=True)
+            p["payloads"] = [payload for payload in p["payloads"] if payload in needed]
+
+# Payloads with a sha256 are stored once in the sha256 directory of the cache,
+# and hardlinked into the directory of every package that has them, so the
+# same payload in other packages or versions is only downloaded once.
+# onDownloaded is called with each package as soon as all of its payloads are
+# there.
+def downloadPackages(selected, cache, allowHashMismatch = False, jobs = 5, mirror = None, onDownloaded = None):
+    pool = multiprocessing.Pool(jobs)
     tasks = []
+    sameContent = []
+    seen = set()
+    remaining = {}
     makedirs(cache)
+    store = os.path.join(cache, "sha256")
+    makedirs(store)
+
+    # Called from the result handler thread of the pool, one at a time
+    def payloadDone(p):
+        remaining[id(p)] -= 1
+        if remaining[id(p)] == 0 and onDownloaded != None:
+            onDownloaded(p)
+
     for p in selected:
-        if not "payloads" in p:
+        if not p.get("payloads"):
+            if onDownloaded != None:
+                onDownloaded(p)
             continue
+        remaining[id(p)] = len(p["payloads"])
         dir = os.path.join(cache, getPackageKey(p))
         makedirs(dir)
         for payload in p["payloads"]:
             name = getPayloadName(payload)
             destname = os.path.join(dir, name)
             fileid = os.path.join(getPackageKey(p), name)
-            args = (payload, destname, fileid, allowHashMismatch)
-            tasks.append(pool.apply_async(_downloadPayload, args))
+            args = (payload, destname, fileid, allowHashMismatch, store, mirror)
+            sha256 = payload.get("sha256", "").lower()
+            if sha256 in seen:
+                # Link these once the first one is in the store
+                sameContent.append((p, args))
+                continue
+            if sha256 != "":
+                seen.add(sha256)
+            tasks.append(pool.apply_async(_downloadPayload, args, callback=lambda _, p=p: payloadDone(p)))
 
     downloaded = sum(task.get() for task in tasks)
+    tasks = [pool.apply_async(_downloadPayload, args, callback=lambda _, p=p: payloadDone(p)) for p, args in sameContent]
+    downloaded += sum(task.get() for task in tasks)
     pool.close()
     print("Downloaded %s in total" % (formatSize(downloaded)))
 
-def _downloadPayload(payload, destname, fileid, allowHashMismatch):
+def _isUrl(location):
+    return "://" in location
+
+def _linkOrCopy(src, dest):
+    tmp = "%s.%s.%d.tmp" % (dest, socket.gethostname(), os.getpid())
+    try:
+        os.link(src, tmp)
+    except OSError:
+        shutil.copyfile(src, tmp)
+    os.replace(tmp, dest)
+
+# Keeps other hosts from downloading the same payload into a shared mirror
+# directory at the same time; they wait and pick it up from there instead.
+@contextlib.contextmanager
+def _mirrorLock(mirror, sha256):
+    if mirror == None or _isUrl(mirror) or fcntl == None:
+        yield
+        return
+    with open(os.path.join(mirror, sha256 + ".lock"), "a") as f:
+        fcntl.flock(f, fcntl.LOCK_EX)
+        try:
+            yield
+        finally:
+            fcntl.flock(f, fcntl.LOCK_UN)
+
+# Payloads larger than twice this size are downloaded in chunks of this size,
+# over several connections at once.
+downloadChunkSize = 64 * 1024 * 1024
+downloadConnections = 4
+
+class _NoRangeSupport(Exception):
+    pass
+
+def _openUrl(url, start = None, end = None):
+    request = urllib.request.Request(url)
+    if start != None:
+        request.add_header("Range", "bytes=%d-%s" % (start, "" if end == None else str(end - 1)))
+    return urllib.request.urlopen(request)
+
+def _copyStream(response, f, hash = None):
+    copied = 0
+    for byteBlock in iter(lambda: response.read(65536), b""):
+        f.write(byteBlock)
+        if hash != None:
+            hash.update(byteBlock)
+        copied += len(byteBlock)
+    return copied
+
+def _removePartial(partname):
+    for name in partname, partname + ".chunks":
+        if os.access(name, os.F_OK):
+            os.remove(name)
+
+# Downloads into partname, resuming from where an earlier attempt stopped if
+# the server allows it, and returns the sha256 of the whole file.
+def _downloadStream(url, payload, partname):
+    sha256Hash = hashlib.sha256()
+    offset = 0
+    if os.access(partname, os.F_OK):
+        with open(partname, "rb") as f:
+            for byteBlock in iter(lambda: f.read(65536), b""):
+                sha256Hash.update(byteBlock)
+                offset += len(byteBlock)
+    if offset > 0 and offset == payload.get("size"):
+        return sha256Hash
+
+    try:
+        response = _openUrl(url, offset if offset > 0 else None)
+    except urllib.error.HTTPError as e:
+        if e.code == 416:
+            # Whatever is there doesn't match the file any longer
+            _removePartial(partname)
+        raise
+    with response:
+        mode = "ab"
+        if offset > 0 and response.status != 206:
+            # The server sends the whole file, start over
+            sha256Hash = hashlib.sha256()
+            mode = "wb"
+        with open(partname, mode) as f:
+            _copyStream(response, f, sha256Hash)
+    return sha256Hash
+
+# Downloads chunks of partname in parallel, with Range requests. The chunks
+# that are done are listed in partname.chunks, so an interrupted download only
+# needs to fetch what is missing. The file is hashed in order, chunk by chunk,
+# while the later chunks are still downloading.
+def _downloadChunked(url, partname, size):
+    chunks = [(start, min(start + downloadChunkSize, size)) for start in range(0, size, downloadChunkSize)]
+    chunksname = partname + ".chunks"
+    done = set()
+    if os.access(partname, os.F_OK) and os.path.getsize(partname) == size and os.access(chunksname, os.F_OK):
+        with open(chunksname, "r") as f:
+            done = set(int(line) for line in f if line.strip().isdigit())
+    else:
+        _removePartial(partname)
+        with open(partname, "wb") as f:
+            f.truncate(size)
+
+    lock = threading.Lock()
+    cancelled = threading.Event()
+    def fetch(i):
+        if cancelled.is_set():
+            return
+        start, end = chunks[i]
+        with _openUrl(url, start, end) as response:
+            if response.status != 206:
+                raise _NoRangeSupport()
+            with open(partname, "r+b") as f:
+                f.seek(start)
+                if _copyStream(response, f) != end - start:
+                    raise Exception("Incomplete chunk at offset %d" % start)
+        with lock:
+            with open(chunksname, "a") as f:
+                f.write("%d\n" % i)
+
+    sha256Hash = hashlib.sha256()
+    with multiprocessing.pool.ThreadPool(downloadConnections) as pool:
+        results = [None if i in done else pool.apply_async(fetch, (i,)) for i in range(len(chunks))]
+        try:
+            with open(partname, "rb") as f:
+                for (start, end), result in zip(chunks, results):
+                    if result != None:
+                        result.get()
+                    f.seek(start)
+                    left = end - start
+                    while left > 0:
+                        byteBlock = f.read(min(left, 65536))
+                        sha256Hash.update(byteBlock)
+                        left -= len(byteBlock)
+        except BaseException:
+            # Leaving the pool doesn't stop the chunks that are downloading,
+            # and those mustn't write to the files once the caller removes
+            # them, so skip the rest and wait for them.
+            cancelled.set()
+            for result in results:
+                if result != None:
+                    result.wait()
+            raise
+    os.remove(chunksname)
+    return sha256Hash
+
+# Downloads url into partname and checks its hash, returns whether it matched
+def _fetch(url, payload, partname, fileid, allowHashMismatch):
+    size = payload.get("size", 0)
+    sha256Hash = None
+    if size > 2 * downloadChunkSize:
+        try:
+            sha256Hash = _downloadChunked(url, partname, size)
+        except _NoRangeSupport:
+            _removePartial(partname)
+    if sha256Hash == None:
+        sha256Hash = _downloadStream(url, payload, partname)
+    if "sha256" in payload:
+        if sha256Hash.hexdigest().lower() != payload["sha256"].lower():
+            if allowHashMismatch:
+                print("WARNING: Incorrect hash for downloaded file %s" % (fileid), flush=True)
+                return False
+            else:
+                # Don't resume from a broken file on the next attempt
+                _removePartial(partname)
+                raise Exception("Incorrect hash for downloaded file %s, aborting" % fileid)
+    return True
+
+# Gets a payload into the store, from the mirror or by downloading it.
+# Returns the number of bytes downloaded.
+def _fetchToStore(payload, blob, destname, fileid, allowHashMismatch, mirror):
+    sha256 = os.path.basename(blob)
+    if mirror != None and not _isUrl(mirror) and os.access(os.path.join(mirror, sha256), os.F_OK):
+        # A truncated or corrupted file in a shared mirror would end up in
+        # every install; download it instead, which also replaces it there.
+        if sha256File(os.path.join(mirror, sha256)).lower() == sha256.lower():
+            print("Copying %s from mirror" % (fileid), flush=True)
+            _linkOrCopy(os.path.join(mirror, sha256), blob)
+            return 0
+        print("WARNING: Incorrect hash for %s in the mirror, downloading it" % (fileid), flush=True)
+
+    size = payload.get("size", 0)
+    partname = blob + ".part"
+    if mirror != None and _isUrl(mirror):
+        try:
+            print("Downloading %s from mirror (%s)" % (fileid, formatSize(size)), flush=True)
+            if _fetch(mirror.rstrip("/") + "/" + sha256, payload, partname, fileid, False):
+                os.replace(partname, blob)
+                return size
+        except Exception as e:
+            print("%s: %s, trying %s" % (type(e).__name__, e, payload["url"]), flush=True)
+            _removePartial(partname)
+
+    print("Downloading %s (%s)" % (fileid, formatSize(size)), flush=True)
+    if not _fetch(payload["url"], payload, partname, fileid, allowHashMismatch):
+        # Keep it out of the store, it isn't what the sha256 says
+        os.replace(partname, destname)
+        return size
+    os.replace(partname, blob)
+    if mirror != None and not _isUrl(mirror):
+        _linkOrCopy(blob, os.path.join(mirror, sha256))
+    return size
+
+def _downloadPayload(payload, destname, fileid, allowHashMismatch, store = None, mirror = None):
     attempts = 5
+    sha256 = payload.get("sha256", "").lower()
+    blob = os.path.join(store, sha256) if store != None and sha256 != "" else None
     for attempt in range(attempts):
         try:
             if os.access(destname, os.F_OK):
                 if "sha256" in payload:
+                    if blob != None and os.access(blob, os.F_OK) and os.path.samefile(blob, destname):
+                        print("Using existing file %s" % (fileid), flush=True)
+                        return 0
                     if sha256File(destname).lower() != payload["sha256"].lower():
                         print("Incorrect existing file %s, removing" % (fileid), flush=True)
                         os.remove(destname)
                     else:
                         print("Using existing file %s" % (fileid), flush=True)
+                        if blob != None and not os.access(blob, os.F_OK):
+                            _linkOrCopy(destname, blob)
                         return 0
                 else:
                     return 0
-            size = 0
-            if "size" in payload:
-                size = payload["size"]
-            print("Downloading %s (%s)" % (fileid, formatSize(size)), flush=True)
-            urllib.request.urlretrieve(payload["url"], destname)
-            if "sha256" in payload:
-                if sha256File(destname).lower() != payload["sha256"].lower():
-                    if allowHashMismatch:
-                        print("WARNING: Incorrect hash for downloaded file %s" % (fileid), flush=True)
-                    else:
-                        raise Exception("Incorrect hash for downloaded file %s, aborting" % fileid)
-            return size
+            if blob == None:
+                size = payload.get("size", 0)
+                print("Downloading %s (%s)" % (fileid, formatSize(size)), flush=True)
+                partname = destname + ".part"
+                _fetch(payload["url"], payload, partname, fileid, allowHashMismatch)
+                os.replace(partname, destname)
+                return size
+            downloaded = 0
+            if os.access(blob, os.F_OK):
+                print("Using stored file %s" % (fileid), flush=True)
+            else:
+                with _mirrorLock(mirror, sha256):
+                    downloaded = _fetchToStore(payload, blob, destname, fileid, allowHashMismatch, mirror)
+            if os.access(blob, os.F_OK):
+                _linkOrCopy(blob, destname)
+            return downloaded
         except Exception as e:
             if attempt == attempts - 1:
                 raise
             print("%s: %s" % (type(e).__name__, e), flush=True)
 
-def mergeTrees(src, dest):
+def mergeTrees(src, dest, caseSensitive = False):
     if not os.path.isdir(src):
         return
     if not os.path.isdir(dest):
@@ -485,45 +817,58 @@ def mergeTrees(src, dest):
         destname = os.path.join(dest, n)
         if os.path.isdir(srcname):
             if os.path.isdir(destname):
-                mergeTrees(srcname, destname)
-            elif n.lower() in destnames:
+                mergeTrees(srcname, destname, caseSensitive)
+            elif not caseSensitive and n.lower() in destnames:
                 mergeTrees(srcname, os.path.join(dest, destnames[n.lower()]))
             else:
                 shutil.move(srcname, destname)
         else:
             shutil.move(srcname, destname)
 
-def unzipFiltered(zip, dest):
-    tmp = os.path.join(dest, "extract")
+# Returns the directory dest/parts, creating what's missing. Existing
+# directories are matched case insensitively, just like mergeTrees() does.
+# known caches the directory listings.
+def _makedirsMerged(dest, parts, known):
+    for part in parts:
+        if dest not in known:
+            known[dest] = {}
+            if os.path.isdir(dest):
+                for n in os.listdir(dest):
+                    if os.path.isdir(os.path.join(dest, n)):
+                        known[dest][n.lower()] = n
+        entries = known[dest]
+        if part.lower() not in entries:
+            os.mkdir(os.path.join(dest, part))
+            entries[part.lower()] = part
+        dest = os.path.join(dest, entries[part.lower()])
+    return dest
+
+# Writes the files below the given top level directories of the zip straight
+# into their destination directories, merging them into what's already there.
+def unzipFiltered(zip, roots):
+    known = {}
     for f in zip.infolist():
         name = urllib.parse.unquote(f.filename)
-        if "/" in name:
-            sep = name.rfind("/")
-            dir = os.path.join(dest, name[0:sep])
-            makedirs(dir)
-        extracted = zip.extract(f, tmp)
-        shutil.move(extracted, os.path.join(dest, name))
-    shutil.rmtree(tmp)
+        parts = [n for n in name.split("/") if n not in ("", ".", "..")]
+        if len(parts) < 2 or not parts[0] in roots or f.is_dir():
+            continue
+        root = roots[parts[0]]
+        if not root in known:
+            makedirs(root)
+        dir = _makedirsMerged(root, parts[1:-1], known)
+        with zip.open(f) as src, open(os.path.join(dir, parts[-1]), "wb") as dst:
+            shutil.copyfileobj(src, dst, 1024 * 1024)
 
 def unpackVsix(file, dest, listing):
-    temp = os.path.join(dest, "vsix")
-    makedirs(temp)
     with zipfile.ZipFile(file, 'r') as zip:
-        unzipFiltered(zip, temp)
+        # The $MSBuild directory structure is used in WDK.vsix.
+        unzipFiltered(zip, {"Contents": dest, "$MSBuild": os.path.join(dest, "MSBuild")})
         with open(listing, "w") as f:
             for n in zip.namelist():
                 f.write(n + "\n")
-    contents = os.path.join(temp, "Contents")
-    if os.access(contents, os.F_OK):
-        mergeTrees(contents, dest)
-    # This archive directory structure is used in WDK.vsix.
-    msbuild = os.path.join(temp, "$MSBuild")
-    if os.access(msbuild, os.F_OK):
-        mergeTrees(msbuild, os.path.join(dest, "MSBuild"))
-    shutil.rmtree(temp)
 
 def unpackWin10SDK(src, payloads, dest):
-    # We could try to unpack only the MSIs we need here.
+    # The payloads that aren't needed are dropped already by pruneSDKPayloads.
     # Note, this extracts some files into Program Files/..., and some
     # files directly in the root unpack directory. The files we need
     # are under Program Files/... though.
@@ -584,22 +929,77 @@ def unpackWin10WDK(src, dest):
         print("Moving", filename, "into version", wdkVersion);
         shutil.move(props, os.path.join(versionedPath, filename))
 
-def extractPackages(selected, cache, dest):
+# Extracts a single package into dest, returning whether the result should be
+# merged with mergeTrees (like the VSIX contents are) rather than just moved
+# into place (like msiextract writes it).
+def extractPackage(p, cache, dest):
+    type = p["type"]
+    dir = os.path.join(cache, getPackageKey(p))
+    if type == "Vsix":
+        print("Unpacking " + p["id"], flush=True)
+        makedirs(dest)
+        for payload in p["payloads"]:
+            unpackVsix(os.path.join(dir, getPayloadName(payload)), dest, os.path.join(dest, getPackageKey(p) + "-listing.txt"))
+        return True
+    elif isWinSDK(p):
+        print("Unpacking " + p["id"], flush=True)
+        makedirs(dest)
+        unpackWin10SDK(dir, p["payloads"], dest)
+        return False
+    else:
+        print("Skipping unpacking of " + p["id"] + " of type " + type, flush=True)
+        return None
+
+# Extracting the packages is pipelined with downloading them: each package is
+# extracted as soon as its payloads are downloaded, by a pool of jobs, into a
+# staging directory of its own. The staging directories are then merged into
+# dest one by one, in the order of the selection, so the result is the same as
+# when extracting one package after the other right into dest.
+def startExtraction(selected, cache, dest, jobs):
     makedirs(dest)
-    for p in selected:
-        type = p["type"]
-        dir = os.path.join(cache, getPackageKey(p))
-        if type == "Component" or type == "Workload" or type == "Group":
+    extraction = {
+        "pool": multiprocessing.Pool(jobs),
+        "cache": cache,
+        "dest": dest,
+        "staging": os.path.join(dest, ".staging"),
+        "index": {id(p): i for i, p in enumerate(selected)},
+        "selected": selected,
+        "tasks": {},
+    }
+    makedirs(extraction["staging"])
+    return extraction
+
+def extractDownloaded(extraction, p):
+    if p["type"] == "Component" or p["type"] == "Workload" or p["type"] == "Group":
+        return
+    i = extraction["index"][id(p)]
+    staging = os.path.join(extraction["staging"], str(i))
+    extraction["tasks"][i] = extraction["pool"].apply_async(extractPackage, (p, extraction["cache"], staging))
+
+# Returns the files each package unpacked, relative to dest, by package key.
+def finishExtraction(extraction):
+    files = {}
+    for i, p in enumerate(extraction["selected"]):
+        task = extraction["tasks"].get(i)
+        if task == None:
             continue
-        if type == "Vsix":
-            print("Unpacking " + p["id"])
-            for payload in p["payloads"]:
-                unpackVsix(os.path.join(dir, getPayloadName(payload)), dest, os.path.join(dest, getPackageKey(p) + "-listing.txt"))
-        elif p["id"].startswith("Win10SDK") or p["id"].startswith("Win11SDK"):
-            print("Unpacking " + p["id"])
-            unpackWin10SDK(dir, p["payloads"], dest)
-        else:
-            print("Skipping unpacking of " + p["id"] + " of type " + type)
+        merge = task.get()
+        staging = os.path.join(extraction["staging"], str(i))
+        if merge != None:
+            files[getPackageKey(p)] = listFiles(staging)
+            mergeTrees(staging, extraction["dest"], caseSensitive=not merge)
+        if os.path.isdir(staging):
+            shutil.rmtree(staging)
+    extraction["pool"].close()
+    shutil.rmtree(extraction["staging"])
+    return files
+
+def listFiles(dir):
+    files = []
+    for root, dirs, names in os.walk(dir):
+        for n in names:
+            files.append(os.path.relpath(os.path.join(root, n), dir).replace(os.sep, "/"))
+    return files
 
 def moveVCSDK(unpack, dest):
     # Move the VC and Program Files\Windows Kits\10 directories
@@ -621,6 +1021,98 @@ def moveVCSDK(unpack, dest):
     for extraDir in "DIA SDK", "MSBuild":
         mergeTrees(os.path.join(unpack, extraDir), os.path.join(dest, extraDir))
 
+# Where moveVCSDK moves a file of the unpack directory to, relative to dest,
+# or None if it is removed along with the unpack directory.
+def getInstalledPath(path):
+    kitsPath = "Windows Kits/10/"
+    if sys.platform != "win32":
+        kitsPath = "Program Files/" + kitsPath
+    if path.startswith(kitsPath):
+        return "kits/10/" + path[len(kitsPath):]
+    for dir in "VC", "DIA SDK", "MSBuild":
+        if path.startswith(dir + "/"):
+            return path
+    return None
+
+# The install manifest in dest records for every installed package what it
+# was installed from, and the files it produced. A later run into the same
+# dest only installs the packages that changed, after removing the files of
+# the old versions.
+installManifestName = "install-manifest.json"
+
+def readInstallManifest(dest):
+    name = os.path.join(dest, installManifestName)
+    if not os.access(name, os.F_OK):
+        return {}
+    with open(name) as f:
+        return json.load(f)["packages"]
+
+def writeInstallManifest(dest, installed):
+    name = os.path.join(dest, installManifestName)
+    makedirs(dest)
+    with open(name + ".tmp", "w") as f:
+        json.dump({"packages": installed}, f, indent=1, sort_keys=True)
+    os.replace(name + ".tmp", name)
+
+# Everything that decides what a package unpacks to
+def getPackageSignature(p, archs, host, keepAll):
+    signature = {
+        "id": p["id"],
+        "version": p.get("version"),
+        "payloads": sorted(payload.get("sha256", payload.get("url", "")).lower() for payload in p.get("payloads", [])),
+    }
+    if isWinSDK(p):
+        signature["architecture"] = sorted(archs)
+        signature["host"] = host
+        signature["keepAll"] = bool(keepAll)
+    return signature
+
+# Finds path below dest, matching the directories case insensitively if it
+# doesn't exist as is, as mergeTrees may have merged them into differently
+# cased ones.
+def _findInstalledPath(dest, path):
+    name = os.path.join(dest, path)
+    if os.path.lexists(name):
+        return name
+    name = dest
+    for part in path.split("/"):
+        if not os.path.isdir(name):
+            return None
+        if not os.path.lexists(os.path.join(name, part)):
+            entries = {n.lower(): n for n in os.listdir(name)}
+            if part.lower() not in entries:
+                return None
+            part = entries[part.lower()]
+        name = os.path.join(name, part)
+    return name
+
+# Removes the files of the given packages that no kept package has too, along
+# with the lowercase symlinks install.sh added for them, and the directories
+# left empty.
+def removeInstalledFiles(dest, removed, kept):
+    keep = set()
+    for entry in kept.values():
+        keep.update(entry["files"])
+    dirs = set()
+    for entry in removed:
+        for path in entry["files"]:
+            if path in keep:
+                continue
+            name = _findInstalledPath(dest, path)
+            if name != None and not os.path.isdir(name):
+                os.remove(name)
+                dirs.add(os.path.dirname(name))
+    for dir in sorted(dirs, key=len, reverse=True):
+        while dir != dest and os.path.isdir(dir) and not os.path.islink(dir):
+            for n in os.listdir(dir):
+                name = os.path.join(dir, n)
+                if os.path.islink(name) and not os.path.exists(name):
+                    os.remove(name)
+            if len(os.listdir(dir)) > 0:
+                break
+            os.rmdir(dir)
+            dir = os.path.dirname(dir)
+
 if __name__ == "__main__":
     parser = getArgsParser()
     args = parser.parse_args()
@@ -683,18 +1175,41 @@ if __name__ == "__main__":
         sys.exit(1)
 
     try:
-        downloadPackages(selected, cache, allowHashMismatch=args.only_download)
+        extraction = None
+        onDownloaded = None
+        if not args.only_download:
+            dest = os.path.abspath(args.dest)
+
+            if args.only_unpack:
+                unpack = dest
+            else:
+                unpack = os.path.join(dest, "unpack")
+
+            archs = [arch.strip().lower() for arch in args.architecture.split(",")]
+            for arch in archs:
+                if arch not in sdkArchs:
+                    print("Unknown architecture " + arch + ", expected one of " + ", ".join(sdkArchs))
+                    sys.exit(1)
+
+            # Only install what changed since the last install into dest
+            installed = readInstallManifest(dest)
+            signatures = {getPackageKey(p): getPackageSignature(p, archs, args.host_arch, args.only_unpack) for p in selected}
+            kept = {key: entry for key, entry in installed.items() if signatures.get(key) == entry["signature"]}
+            if len(installed) > 0:
+                selected = [p for p in selected if getPackageKey(p) not in kept]
+                print("Updating %d packages, keeping %d installed ones" % (len(selected), len(kept)), flush=True)
+                removeInstalledFiles(dest, [entry for key, entry in installed.items() if key not in kept], kept)
+                writeInstallManifest(dest, kept)
+
+            pruneSDKPayloads(selected, cache, archs, args.host_arch, args.only_unpack, args.download_jobs, args.mirror)
+            extraction = startExtraction(selected, cache, unpack, args.unpack_jobs)
+            onDownloaded = functools.partial(extractDownloaded, extraction)
+
+        downloadPackages(selected, cache, allowHashMismatch=args.only_download, jobs=args.download_jobs, mirror=args.mirror, onDownloaded=onDownloaded)
         if args.only_download:
             sys.exit(0)
 
-        dest = os.path.abspath(args.dest)
-
-        if args.only_unpack:
-            unpack = dest
-        else:
-            unpack = os.path.join(dest, "unpack")
-
-        extractPackages(selected, cache, unpack)
+        unpacked = finishExtraction(extraction)
 
         if args.with_wdk_installers is not None:
             unpackWin10WDK(args.with_wdk_installers, unpack)
@@ -703,6 +1218,13 @@ if __name__ == "__main__":
             moveVCSDK(unpack, dest)
             if not args.keep_unpack:
                 shutil.rmtree(unpack)
+
+        for p in selected:
+            files = unpacked.get(getPackageKey(p), [])
+            if not args.only_unpack:
+                files = [path for path in map(getInstalledPath, files) if path != None]
+            kept[getPackageKey(p)] = {"signature": signatures[getPackageKey(p)], "files": files}
+        writeInstallManifest(dest, kept)
     finally:
         if tempcache != None:
             shutil.rmtree(tempcache)
@@ -0,0 +1,289 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Batching of concurrent compiles for the cl wrapper, coordinated through
+# the directory WINE_MSVC_BATCH. Sourced by cl, which defines cl_exec.
+#
+# Build tools start the cl wrapper once for every source file, and each
+# time pay for starting cl.exe in wine. With batching, a compile of a single
+# source (/c) waits WINE_MSVC_BATCH_WINDOW milliseconds (20 by default) for
+# other compiles with the same options in the same directory, or less once
+# the batch is full. The first of them, the leader, then compiles all their
+# sources with a single cl /MP, and hands each of the others back its
+# object, its part of the output and its exit code. A compile doesn't wait
+# at all if no other one with the same options is running, as in a serial
+# build.
+#
+# cl prints the name of each source before its diagnostics, which is how
+# the output is split up again. cl doesn't allow /MP with /showIncludes, so
+# then the sources of a batch are compiled one after another by the same
+# cl.exe instead. A batch holds at most WINE_MSVC_BATCH_SIZE sources (the
+# number of CPUs by default), and sources with the same file name go into
+# different batches, as cl writes the objects into one directory.
+
+if command -v sha256sum >/dev/null; then
+    SHA256SUM=sha256sum
+else
+    SHA256SUM="shasum -a 256"
+fi
+
+# Prints when the process $1 was started, to tell it apart from a later one
+# with the same pid.
+cl_batch_started() {
+    local stat
+    if [ -r /proc/$1/stat ]; then
+        read -r stat </proc/$1/stat || return
+        # The fields after the command name, the first being the third.
+        set -- ${stat##*) }
+        echo ${20}
+    else
+        ps -o lstart= -p $1 2>/dev/null
+    fi
+}
+
+# Compiles the sources of the requests (files holding the source and the
+# object to write it to) given first, $1 of them, with the options given
+# after them, into the batch directory $2, and writes the result of each
+# into the directory of its request.
+cl_batch_compile() {
+    local n=$1 batch=$2 a req src obj mp=/MP srcs=() reqs=()
+    shift 2
+    reqs=("${@:1:$n}")
+    shift $n
+    for a; do
+        case $a in
+        [-/]showIncludes) mp= ;;
+        esac
+    done
+    for req in "${reqs[@]}"; do
+        { read -r src; } <"$req"
+        srcs+=("$src")
+    done
+
+    local out ec
+    out=$(mktemp -d "$batch/out.XXXXXX") || return
+    cl_exec "$@" $mp /c /Fo"$out/" "${srcs[@]}" >"$out/stdout" 2>"$out/stderr"
+    ec=$?
+
+    # Lines before the name of the first source (e.g. warnings about the
+    # options) belong to all of them.
+    printf '%s\n' "${srcs[@]##*/}" | awk -v out="$out/" '
+        NR == FNR { names[$0] = 1; next }
+        FNR == 1 { cur = out "common" }
+        ($0 in names) && !seen[$0]++ { cur = out $0 ".stdout" }
+        { print > cur }' - "$out/stdout"
+
+    # The diagnostics of cl are on stdout, so stderr has few lines, and
+    # nothing to tell the sources apart by. It goes to the requests that
+    # failed, or if none did, only to the first one.
+    local base status res stderr=
+    for req in "${reqs[@]}"; do
+        { read -r src && read -r obj; } <"$req"
+        res=${req%/*}
+        res=${res%/*}/${req##*/req.}
+        base=${src##*/}
+        # A source compiled if and only if cl wrote its object.
+        if [ -f "$out/${base%.*}.obj" ] && mv "$out/${base%.*}.obj" "$obj"; then
+            status=0
+        elif [ $ec -ne 0 ]; then
+            status=$ec
+        else
+            status=1
+        fi
+        cat "$out/common" "$out/$base.stdout" >"$res/stdout" 2>/dev/null
+        if [ $status -ne 0 ] || { [ $ec -eq 0 ] && [ -z "$stderr" ]; }; then
+            cp "$out/stderr" "$res/stderr"
+            stderr=1
+        else
+            : >"$res/stderr"
+        fi
+        # The requester holds the FIFO open, so this never blocks.
+        echo $status 1<>"$res/status"
+    done
+    rm -rf "$out"
+}
+
+# Waits for the compiles with the same options to join the queue
+# $1/queue, a link to the batch directory $1/q.$$, then compiles them all,
+# with the options given after it.
+cl_batch_lead() {
+    local dir=$1 window=${WINE_MSVC_BATCH_WINDOW:-20} size=${WINE_MSVC_BATCH_SIZE:-$(nproc 2>/dev/null || echo 4)}
+    local batch=$1/q.$$
+    shift
+
+    # Every running compile with these options has a res directory here;
+    # if ours is the only one, nothing is going to join.
+    local req src base pending=("$dir"/res.*)
+    if [ ${#pending[@]} -gt 1 ]; then
+        local waited=0
+        while [ $waited -lt $window ]; do
+            pending=("$batch"/req.*)
+            [ ${#pending[@]} -ge $size ] && break
+            sleep 0.005
+            waited=$((waited + 5))
+        done
+    fi
+
+    # Close the queue; the next compile to come along leads a new one.
+    [ "$(readlink "$dir/queue")" = q.$$ ] && rm -f "$dir/queue"
+
+    # A compile that found the queue just before it was closed may still
+    # get its request in, so look again after each round, until there are
+    # no new ones. One that comes even later sees the leader exit, and
+    # compiles by itself.
+    local -a group next
+    local -A seen taken
+    while :; do
+        pending=()
+        for req in "$batch"/req.*; do
+            [ -f "$req" ] && [ -z "${taken[$req]}" ] && pending+=("$req")
+        done
+        [ ${#pending[@]} -eq 0 ] && break
+        while [ ${#pending[@]} -gt 0 ]; do
+            seen=() group=() next=()
+            for req in "${pending[@]}"; do
+                { read -r src; } <"$req"
+                base=${src##*/}
+                if [ ${#group[@]} -lt $size ] && [ -z "${seen[$base]}" ]; then
+                    seen[$base]=1
+                    group+=("$req")
+                    taken[$req]=1
+                else
+                    next+=("$req")
+                fi
+            done
+            cl_batch_compile ${#group[@]} "$batch" "${group[@]}" "$@" &
+            pending=("${next[@]}")
+        done
+        wait
+    done
+    rm -rf "$batch"
+}
+
+# Compiles with the given arguments, in a batch with the concurrent compiles
+# using the same options.
+cl_batch() {
+    local a src= obj= compile= flags=()
+    # The depfile is written for the whole cl.exe invocation.
+    if [ -n "$WINE_MSVC_DEPFILE" ]; then
+        cl_exec "$@"
+        return
+    fi
+    for a; do
+        case $a in
+        [-/]c)
+            compile=1
+            continue
+            ;;
+        [-/]Fo*)
+            obj=${a:3}
+            obj=${obj#:}
+            continue
+            ;;
+        [-/]E|[-/]EP|[-/]P|[-/]Y[cu]*|[-/]Fp*|[-/]F[aRr]*|[-/]FA*|[-/]Fi*|[-/]Fe*|[-/]doc*|[-/]analyze*|\
+        [-/]sourceDependencies*|[-/]interface|[-/]internalPartition|[-/]ifc*|[-/]headerUnit*|[-/]exportHeader|\
+        [-/]reference*|[-/]link|[-/]MP*|[-/]Gm|[-/]T[cp]?*|@*)
+            cl_exec "$@"
+            return
+            ;;
+        -*)
+            ;;
+        *.[cC]|*.[cC][cC]|*.[cC][pP][pP]|*.[cC][xX][xX])
+            # Options start with a slash as well, like absolute paths.
+            if [ "${a:0:1}" != / ] || [ -f "$a" ]; then
+                [ -n "$src" ] && { cl_exec "$@"; return; }
+                src=$a
+                continue
+            fi
+            ;;
+        esac
+        flags+=("$a")
+    done
+    if [ -z "$compile" ] || [ ! -f "$src" ]; then
+        cl_exec "$@"
+        return
+    fi
+
+    local base=${src##*/}
+    base=${base%.*}.obj
+    case $obj in
+    "")      obj=$base ;;
+    */|*\\)  obj=$obj$base ;;
+    esac
+    [ "${obj:0:1}" = / ] || obj=$PWD/$obj
+
+    local key
+    key=$({
+        echo "$MSVCVER $SDKVER $ARCH"
+        echo "$PWD"
+        printf '%s\n' "${flags[@]}"
+        for a in INCLUDE CL _CL_ WINE_MSVC_STDOUT_SED WINE_MSVC_STDERR_SED; do
+            echo "$a=${!a}"
+        done
+    } | $SHA256SUM) || { cl_exec "$@"; return; }
+
+    local dir=$WINE_MSVC_BATCH/${key%% *} res fd
+    mkdir -p "$dir" && res=$(mktemp -d "$dir/res.XXXXXX") && mkfifo "$res/status" ||
+        { cl_exec "$@"; return; }
+    # Keep the FIFO open from the start, for the leader to never wait for
+    # us and for us to never miss the result.
+    exec {fd}<>"$res/status"
+    printf '%s\n' "$src" "$obj" >"$res/req"
+
+    # The leader is known by its pid and start time, in the file leader of
+    # its queue, as the pid alone may be reused once it's gone.
+    local leader= started=
+    while :; do
+        if mkdir "$dir/q.$$" 2>/dev/null &&
+           echo "$$ $(cl_batch_started $$)" >"$dir/q.$$/leader" &&
+           ln -sn q.$$ "$dir/queue" 2>/dev/null; then
+            mv "$res/req" "$dir/q.$$/req.${res##*/}"
+            cl_batch_lead "$dir" "${flags[@]}"
+            break
+        fi
+        rm -rf "$dir/q.$$"
+        leader=$(readlink "$dir/queue")
+        if ! read -r leader started 2>/dev/null <"$dir/$leader/leader"; then
+            # A queue left behind by a leader that was recovered from.
+            [ -n "$leader" ] && [ ! -d "$dir/$leader" ] &&
+                [ "$(readlink "$dir/queue")" = "$leader" ] && rm -f "$dir/queue"
+            continue
+        fi
+        # To notice if the leader is gone before it took the request.
+        echo "$leader $started" >"$res/leader"
+        # This fails if the leader closed the queue in the meantime.
+        mv "$res/req" "$dir/queue/req.${res##*/}" 2>/dev/null && break
+    done
+
+    local ec
+    while ! read -r -t 1 ec <&$fd; do
+        [ -f "$res/leader" ] && read -r leader started <"$res/leader"
+        # If the leader is gone, compile it here instead.
+        if [ -n "$leader" ] && [ "$(cl_batch_started $leader)" != "$started" ]; then
+            [ "$(readlink "$dir/queue")" = q.$leader ] && rm -f "$dir/queue"
+            rm -rf "$dir/q.$leader"
+            exec {fd}<&-
+            rm -rf "$res"
+            cl_exec "$@"
+            return
+        fi
+    done
+    exec {fd}<&-
+    cat "$res/stdout"
+    cat "$res/stderr" >&2
+    rm -rf "$res"
+    return $ec
+}
@@ -0,0 +1,191 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# A cache of compiled objects for the cl wrapper, in the directory
+# WINE_MSVC_CACHE. Sourced by cl, which defines cl_compile.
+#
+# The key of an entry is the hash of the source file, the command line
+# (except for the output names, but with /Z7 the object has its own name in
+# it), MSVCVER/SDKVER/ARCH, the working directory and the environment
+# variables that affect the compilation. Each entry holds the object file,
+# the output of cl.exe, and the hashes of all the headers it included, as
+# reported by /showIncludes. On a hit, i.e. if none of the headers changed,
+# the object is restored and the output replayed without starting wine at
+# all.
+#
+# Only compiling (/c) a single source file is cached; anything that reads
+# or writes other files than the headers and the object (PDBs with /Zi,
+# precompiled headers, response files, listings etc.) is passed through.
+
+if command -v sha256sum >/dev/null; then
+    SHA256SUM=sha256sum
+else
+    SHA256SUM="shasum -a 256"
+fi
+
+# Prints the name of the object file the arguments compile, along with the
+# key of the cache entry for it, or fails if they can't be cached.
+cl_cache_key() {
+    local a src= obj= compile= z7= args=()
+    for a; do
+        case $a in
+        [-/]c)
+            compile=1
+            ;;
+        [-/]Z7)
+            z7=1
+            ;;
+        [-/]showIncludes)
+            continue
+            ;;
+        [-/]Fo*)
+            obj=${a:3}
+            obj=${obj#:}
+            continue
+            ;;
+        [-/]Fd*)
+            # Only used with /Zi, which isn't cached.
+            continue
+            ;;
+        [-/]Z[iI]|[-/]E|[-/]EP|[-/]P|[-/]Y[cu]*|[-/]Fp*|[-/]F[aRr]*|[-/]FA*|[-/]Fi*|[-/]Fe*|[-/]doc*|[-/]analyze*|\
+        [-/]sourceDependencies*|[-/]interface|[-/]internalPartition|[-/]ifc*|[-/]headerUnit*|[-/]exportHeader|\
+        [-/]reference*|[-/]link|@*)
+            return 1
+            ;;
+        [-/]T[cp]?*)
+            [ -n "$src" ] && return 1
+            src=${a:3}
+            ;;
+        -*)
+            ;;
+        *.[cC]|*.[cC][cC]|*.[cC][pP][pP]|*.[cC][xX][xX])
+            # Options start with a slash as well, like absolute paths.
+            case $a in
+            /*) [ -f "$a" ] || { args+=("$a"); continue; } ;;
+            esac
+            [ -n "$src" ] && return 1
+            src=$a
+            ;;
+        esac
+        args+=("$a")
+    done
+    [ -n "$compile" ] && [ -f "$src" ] || return 1
+
+    # Without (or with a directory in) /Fo, the object is named after the
+    # source file.
+    local base=${src##*/}
+    base=${base%.*}.obj
+    case $obj in
+    "")      obj=$base ;;
+    */|*\\)  obj=$obj$base ;;
+    esac
+    case " $CL $_CL_ " in
+    *[[:space:]][-/]Z7[[:space:]]*) z7=1 ;;
+    esac
+
+    local key
+    key=$({
+        echo "$MSVCVER $SDKVER $ARCH"
+        echo "$PWD"
+        printf '%s\n' "${args[@]}"
+        [ -z "$z7" ] || echo "/Fo$obj"
+        for a in INCLUDE CL _CL_ WINE_MSVC_STDOUT_SED WINE_MSVC_STDERR_SED; do
+            echo "$a=${!a}"
+        done
+        $SHA256SUM <"$src"
+    } | $SHA256SUM) || return 1
+    echo "$obj"
+    echo "${key%% *}"
+}
+
+# Replays the output of cl.exe stored in the files $1.stdout and
+# $1.stderr, without the /showIncludes notes unless they were asked for.
+cl_cache_replay() {
+    if [ -n "$showincludes" ]; then
+        cat "$1.stdout"
+        cat "$1.stderr" >&2
+    else
+        grep -v '^Note: including file:' "$1.stdout"
+        grep -v '^Note: including file:' "$1.stderr" >&2
+    fi
+    return 0
+}
+
+# Writes the depfile WINE_MSVC_DEPFILE from the headers of the entry $1, like
+# msvctricks does when compiling.
+cl_cache_depfile() {
+    awk -v target="$WINE_MSVC_DEPFILE_TARGET" '
+        function escape(s) { gsub(/\$/, "$$", s); gsub(/[ #]/, "\\\\&", s); return s }
+        BEGIN { printf "%s:", escape(target) }
+        { sub(/^[0-9a-f]+  /, ""); printf " \\\n  %s", escape($0) }
+        END { printf "\n" }' "$1/deps" >"$WINE_MSVC_DEPFILE"
+}
+
+# Compiles with the given arguments, through the cache.
+cl_cache() {
+    local a showincludes= obj key
+    for a; do
+        case $a in
+        [-/]showIncludes) showincludes=1 ;;
+        esac
+    done
+
+    { read -r obj && read -r key; } < <(cl_cache_key "$@")
+    if [ -z "$key" ]; then
+        cl_compile "$@"
+        return
+    fi
+
+    local entry=$WINE_MSVC_CACHE/${key:0:2}/$key
+    if [ -f "$entry/obj" ] &&
+       { [ ! -s "$entry/deps" ] || $SHA256SUM -c --status "$entry/deps" 2>/dev/null; } &&
+       cp "$entry/obj" "$obj"; then
+        cl_cache_replay "$entry/output"
+        [ -z "$WINE_MSVC_DEPFILE" ] || cl_cache_depfile "$entry"
+        return 0
+    fi
+
+    mkdir -p "${entry%/*}" || { cl_compile "$@"; return; }
+    local tmp
+    tmp=$(mktemp -d "$entry.tmp.XXXXXX") || { cl_compile "$@"; return; }
+
+    local ec
+    if [ -n "$showincludes" ]; then
+        cl_compile "$@" >"$tmp/output.stdout" 2>"$tmp/output.stderr"
+    else
+        cl_compile "$@" /showIncludes >"$tmp/output.stdout" 2>"$tmp/output.stderr"
+    fi
+    ec=$?
+    cl_cache_replay "$tmp/output"
+
+    # Only store the entry if all headers are known by their unix path.
+    local deps
+    deps=$(sed -n 's/^Note: including file: *//p' "$tmp/output.stdout" "$tmp/output.stderr" | sort -u)
+    if [ $ec -eq 0 ] && [ -f "$obj" ] && ! grep -q '^[^/]' <<<"$deps" &&
+       cp "$obj" "$tmp/obj" &&
+       { [ -z "$deps" ] || tr '\n' '\0' <<<"$deps" | xargs -0 $SHA256SUM; } >"$tmp/deps"; then
+        # Replace the entry as a whole, so that concurrent lookups never see
+        # the object of one compilation with the headers of another.
+        rm -rf "$entry"
+        mv "$tmp" "$entry" 2>/dev/null
+        # If another compilation stored the entry in the meantime, ours was
+        # moved into it instead.
+        rm -rf "$tmp" "$entry/${tmp##*/}"
+    else
+        rm -rf "$tmp"
+    fi
+    return $ec
+}
@@ -0,0 +1,178 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Distributed compilation for the cl wrapper, over ssh to the hosts in
+# WINE_MSVC_DIST_HOSTS (separated by spaces). Sourced by cl, which defines
+# cl_exec.
+#
+# The source is preprocessed locally with /P, which leaves unix paths in
+# the #line directives, and the preprocessed file is sent along with the
+# remaining options to "cl-dist.sh --worker" on a randomly picked host. The
+# worker compiles it with the cl wrapper of its own installation (using a
+# persistent msvctricks server there), and sends back the object and the
+# output. Only compiling (/c) a single source file is distributed; if the
+# host can't be reached, or doesn't have the same MSVC and SDK versions,
+# the compile is done locally instead.
+#
+# The installation is expected to be in the same directory on all hosts,
+# unless WINE_MSVC_DIST_BIN says where it is. WINE_MSVC_DIST_SSH can
+# replace the ssh command.
+
+# Compiles with the given arguments on a remote host.
+cl_dist() {
+    local a src= obj= compile= lang=/Tp skip= local_args=() remote_args=()
+    for a; do
+        if [ -n "$skip" ]; then
+            # The value of a preprocessor option, given separately
+            skip=
+            local_args+=("$a")
+            continue
+        fi
+        case $a in
+        [-/]c)
+            compile=1
+            continue
+            ;;
+        [-/]Fo*)
+            obj=${a:3}
+            obj=${obj#:}
+            continue
+            ;;
+        [-/]I|[-/]D|[-/]U|[-/]FI|[-/]external:I)
+            skip=1
+            local_args+=("$a")
+            continue
+            ;;
+        [-/]I*|[-/]D*|[-/]U*|[-/]FI*|[-/]external:I*|[-/]X|[-/]u|[-/]showIncludes)
+            # Only used when preprocessing
+            local_args+=("$a")
+            continue
+            ;;
+        [-/]Z[iI]|[-/]E|[-/]EP|[-/]P|[-/]Y[cu]*|[-/]Fp*|[-/]F[aRr]*|[-/]FA*|[-/]Fi*|[-/]Fe*|[-/]doc*|[-/]analyze*|\
+        [-/]sourceDependencies*|[-/]interface|[-/]internalPartition|[-/]ifc*|[-/]headerUnit*|[-/]exportHeader|\
+        [-/]reference*|[-/]link|@*)
+            cl_exec "$@"
+            return
+            ;;
+        [-/]T[cp]?*)
+            [ -n "$src" ] && { cl_exec "$@"; return; }
+            src=${a:3}
+            lang=${a:0:3}
+            local_args+=("$a")
+            continue
+            ;;
+        -*)
+            ;;
+        *.[cC]|*.[cC][cC]|*.[cC][pP][pP]|*.[cC][xX][xX])
+            # Options start with a slash as well, like absolute paths.
+            if [ "${a:0:1}" != / ] || [ -f "$a" ]; then
+                [ -n "$src" ] && { cl_exec "$@"; return; }
+                src=$a
+                case $a in
+                *.[cC]) lang=/Tc ;;
+                esac
+                local_args+=("$a")
+                continue
+            fi
+            ;;
+        esac
+        local_args+=("$a")
+        remote_args+=("$a")
+    done
+    if [ -z "$compile" ] || [ ! -f "$src" ]; then
+        cl_exec "$@"
+        return
+    fi
+
+    local base=${src##*/}
+    base=${base%.*}.obj
+    case $obj in
+    "")      obj=$base ;;
+    */|*\\)  obj=$obj$base ;;
+    esac
+
+    local tmp
+    tmp=$(mktemp -d -t wine-msvc-dist.XXXXXX) || { cl_exec "$@"; return; }
+
+    # cl prints the name of the source file first, and the notes of
+    # /showIncludes along with the diagnostics on stdout, which is what
+    # build tools expect.
+    local ec
+    WINE_MSVC_FIXUP_LINE=$tmp/in.i cl_exec "${local_args[@]}" /P /Fi$tmp/in.i >$tmp/pre 2>$tmp/pre.err
+    ec=$?
+    echo "${src##*/}"
+    grep -vxF "${src##*/}" $tmp/pre
+    cat $tmp/pre.err >&2
+    if [ $ec -ne 0 ]; then
+        rm -rf $tmp
+        return $ec
+    fi
+
+    local hosts=($WINE_MSVC_DIST_HOSTS)
+    local host=${hosts[$RANDOM % ${#hosts[@]}]}
+    local bin=${WINE_MSVC_DIST_BIN:-$(cd "$(dirname "$BASH_SOURCE")" && pwd)}
+    local cmd
+    cmd=$(printf '%q ' "$bin/cl-dist.sh" --worker "$MSVCVER" "$SDKVER" $lang "${remote_args[@]}")
+    tar -C $tmp -cf - in.i | ${WINE_MSVC_DIST_SSH:-ssh -o BatchMode=yes} $host "$cmd" |
+        tar -C $tmp -xf - 2>/dev/null
+    if [ ! -f $tmp/status ] || ! read -r ec <$tmp/status; then
+        # The host couldn't compile it at all; do it here instead.
+        rm -rf $tmp
+        cl_exec "$@" | grep -vxF "${src##*/}"
+        return ${PIPESTATUS[0]}
+    fi
+
+    grep -vxF in.i $tmp/stdout
+    cat $tmp/stderr >&2
+    if [ "$ec" = 0 ] && ! mv $tmp/out.obj "$obj"; then
+        ec=1
+    fi
+    rm -rf $tmp
+    return $ec
+}
+
+# Runs on the remote host: compiles the preprocessed source in.i, read as
+# a tar archive from stdin, and writes out.obj, the output and the exit
+# code back as a tar archive.
+cl_dist_worker() {
+    local msvcver=$1 sdkver=$2 lang=$3 bin=$(cd "$(dirname "$0")" && pwd) tmp
+    shift 3
+    . "$bin/msvcenv.sh"
+    if [ "$msvcver" != "$MSVCVER" ] || [ "$sdkver" != "$SDKVER" ]; then
+        echo "$(hostname): MSVC $MSVCVER and SDK $SDKVER, not $msvcver and $sdkver" >&2
+        exit 1
+    fi
+    tmp=$(mktemp -d -t wine-msvc-dist.XXXXXX) || exit 1
+    trap "rm -rf $tmp" EXIT
+    tar -C $tmp -xf - || exit 1
+
+    # Reuse the same persistent server for all jobs sent to this host, in
+    # WINE_MSVC_DIST_SERVER or the default directory of wine-msvc-server.sh.
+    local server
+    if server=$("$bin/wine-msvc-server.sh" start $WINE_MSVC_DIST_SERVER); then
+        eval "$server"
+    else
+        unset WINE_MSVC_SERVER
+    fi
+    unset WINE_MSVC_DIST_HOSTS WINE_MSVC_CACHE
+    (cd $tmp && "$bin/cl" "$@" /c /Foout.obj ${lang}in.i >stdout 2>stderr; echo $? >status)
+    tar -C $tmp -cf - $(cd $tmp && ls out.obj 2>/dev/null) stdout stderr status
+}
+
+if [ "$0" = "$BASH_SOURCE" ] && [ "$1" = --worker ]; then
+    shift
+    cl_dist_worker "$@"
+fi
@@ -14,18 +14,53 @@
 # ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+# The spans of all tracing (see wine-msvc.sh) for a wrapper invocation
+# go by the pid of the wrapper, the outermost one if one runs another (like
+# cl running cl-cache.sh and wine-msvc.sh).
+if [ -n "$WINE_MSVC_TRACE" ]; then
+    : ${WINE_MSVC_TRACE_PID:=$$}
+    export WINE_MSVC_TRACE_PID
+    msvcenv_start=$EPOCHREALTIME
+fi
+
 SDK=kits\\10
 SDK_UNIX=kits/10
-BASE_UNIX=$(cd "$(dirname "${BASH_SOURCE[0]}")"/.. && pwd)
-# Support having the wrappers in a directory one or two levels below the
-# installation directory.
-if [ ! -d "$BASE_UNIX/vc" ]; then
-    BASE_UNIX=$(cd "$BASE_UNIX"/.. && pwd)
-fi
-BASE=$(winepath -w $BASE_UNIX)
 MSVCVER=14.13.26128
 SDKVER=10.0.16299.0
 ARCH=x86
+# install.sh fills in the directory it installed to, along with its DOS path
+# and the wine prefix that was resolved in. As long as the wrappers are used
+# from there, in the same prefix, these are used instead of translating the
+# path again.
+INSTALL_BASE_UNIX=
+INSTALL_BASE=
+INSTALL_WINEPREFIX=
+if [ -n "$INSTALL_BASE" ] && [ "${WINEPREFIX:-$HOME/.wine}" = "$INSTALL_WINEPREFIX" ] &&
+   [ "${BASH_SOURCE[0]%/*}/../.." -ef "$INSTALL_BASE_UNIX" ]; then
+    BASE_UNIX=$INSTALL_BASE_UNIX
+    BASE=$INSTALL_BASE
+else
+    BASE_UNIX=$(cd "$(dirname "${BASH_SOURCE[0]}")"/.. && pwd)
+    # Support having the wrappers in a directory one or two levels below the
+    # installation directory.
+    if [ ! -d "$BASE_UNIX/vc" ]; then
+        BASE_UNIX=$(cd "$BASE_UNIX"/.. && pwd)
+    fi
+    # If the Z: drive maps the root directory, like it does by default, the
+    # translation is trivial and doesn't need a wine process launch.
+    case "$BASE_UNIX" in
+    *[\\:*?\"\<\>\|]*)
+        BASE=$(winepath -w $BASE_UNIX)
+        ;;
+    *)
+        if [ "${WINEPREFIX:-$HOME/.wine}/dosdevices/z:" -ef / ]; then
+            BASE="z:${BASE_UNIX//\//\\}"
+        else
+            BASE=$(winepath -w $BASE_UNIX)
+        fi
+        ;;
+    esac
+fi
 MSVCBASE="$BASE\\vc"
 SDKBASE="$BASE\\$SDK"
 MSVCDIR="$MSVCBASE\\tools\\msvc\\$MSVCVER"
@@ -37,6 +72,16 @@ MSBUILDBINDIR=$BASE_UNIX/MSBuild/Current/Bin/amd64
 export INCLUDE="$MSVCDIR\\include;$SDKINCLUDE\\shared;$SDKINCLUDE\\ucrt;$SDKINCLUDE\\um;$SDKINCLUDE\\winrt;$SDKINCLUDE\\km"
 export LIB="$MSVCDIR\\lib\\$ARCH;$SDKLIB\\ucrt\\$ARCH;$SDKLIB\\um\\$ARCH;$SDKLIB\\km\\$ARCH"
 export LIBPATH="$LIB"
-# "$MSVCDIR\\bin\\Hostx64\\x64" is included in PATH for DLLs.
-export WINEPATH="$(winepath -w $BINDIR);$(winepath -w $SDKBINDIR);$MSVCDIR\\bin\\Hostx64\\x64"
+# The bin directories are within BASE_UNIX, so their DOS paths follow from
+# BASE. "$MSVCDIR\\bin\\Hostx64\\x64" is included in PATH for DLLs.
+WINBINDIR=${BINDIR#"$BASE_UNIX"}
+WINSDKBINDIR=${SDKBINDIR#"$BASE_UNIX"}
+export WINEPATH="$BASE${WINBINDIR//\//\\};$BASE${WINSDKBINDIR//\//\\};$MSVCDIR\\bin\\Hostx64\\x64"
 export WINEDLLOVERRIDES="vcruntime140=n;vcruntime140_1=n"
+
+if [ -n "$WINE_MSVC_TRACE" ] && [ -n "$msvcenv_start" ]; then
+    msvcenv_start=${msvcenv_start/[.,]/}
+    msvcenv_end=${EPOCHREALTIME/[.,]/}
+    printf '{"name":"msvcenv.sh","cat":"wrapper","ph":"X","ts":%s,"dur":%s,"pid":%s,"tid":%s}\n' \
+        $msvcenv_start $((msvcenv_end - msvcenv_start)) $WINE_MSVC_TRACE_PID $WINE_MSVC_TRACE_PID >>"$WINE_MSVC_TRACE"
+fi
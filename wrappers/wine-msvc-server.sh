@@ -0,0 +1,240 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Starts and stops a persistent msvctricks server, which the wrappers hand
+# their jobs to when WINE_MSVC_SERVER points to its directory:
+#
+#     eval $(wine-msvc-server.sh start)
+#     ninja
+#     wine-msvc-server.sh stop
+#
+# Starting it also makes sure that the wineserver stays up for as long as
+# the server runs (even for the tools that aren't run through it), and
+# reads the tools into the page cache, so that no tool invocation during the
+# build pays for booting the prefix or loading the tools from disk.
+#
+# A single wineserver handles the requests of all processes in its prefix on
+# one thread, which limits highly parallel builds. With
+# WINE_MSVC_SERVER_SHARDS=N, start runs N servers instead, in subdirectories
+# of the server directory, each with a prefix and wineserver of its own, and
+# wine-msvc.sh hands every job to the one with the fewest jobs running. The
+# shard prefixes are made from the current one (WINEPREFIX), with copies of
+# its registry and drive mappings, sharing its drive_c. Named objects, like
+# the WINE_MSVC_HEAVY_JOBS mutexes of msvctricks, are per wineserver, which
+# is why wine-msvc.sh takes those slots with flock instead.
+#
+# With WINE_MSVC_MSPDBSRV set, start also runs an mspdbsrv.exe (per prefix)
+# that doesn't shut down until stop, and points all tools of the build to it
+# with _MSPDBSRV_ENDPOINT_. The PDB writes of /Zi compiles and incremental
+# links then all go to that one, instead of to one that the first tool
+# needing it starts, and that shuts down again whenever it's idle. It's
+# the one of the host tools, and if it doesn't start, the tools aren't
+# pointed to it.
+
+MSVCTRICKS_EXE="$(dirname $0)/../msvctricks.exe"
+WINE=$(command -v wine64 || command -v wine || false)
+WINESERVER=$(command -v wineserver || echo "${WINE%/*}/wineserver")
+export WINEDEBUG=${WINEDEBUG:-"-all"}
+
+usage() {
+	echo "usage: $0 start|stop|status [dir]" >&2
+	exit 1
+}
+
+# The bin directory of the tools for the host itself (bin/Hostx64/x64, or
+# bin/Hostarm64/arm64 on arm64 hosts), from the BINDIR of msvcenv.sh.
+host_bindir() {
+	local dir=${BINDIR%/*}
+	echo "$dir/${dir##*/Host}"
+}
+
+alive() {
+	local pid
+	[ -p "$1/jobs" ] && read -r pid <"$1/pid" 2>/dev/null && kill -0 $pid &>/dev/null
+}
+
+# Starts a server in the directory $1, unless one is running already.
+start_server() {
+	local dir=$1
+	alive "$dir" && return
+	rm -f "$dir/jobs" "$dir/pid"
+	mkdir -p "$dir" && mkfifo "$dir/jobs" || return 1
+	# A persistent wineserver keeps the registry loaded until stop,
+	# even if wine isn't used for a while. If one is running already,
+	# this fails and that one is left as it is.
+	if "$WINESERVER" -p &>/dev/null </dev/null 9>&-; then
+		touch "$dir/wineserver"
+	fi
+	if [ -n "$WINE_MSVC_MSPDBSRV" ] && ! mspdbsrv_alive "$dir"; then
+		start_mspdbsrv "$dir"
+	fi
+	$WINE "$MSVCTRICKS_EXE" --serve "$dir" &>/dev/null </dev/null 9>&- &
+	echo $! >"$dir/pid"
+}
+
+mspdbsrv_alive() {
+	local pid
+	[ -f "$1/mspdbsrv" ] && read -r pid <"$1/mspdbsrv" && kill -0 $pid &>/dev/null
+}
+
+# Starts the mspdbsrv.exe for the server in $1, listening on $ENDPOINT.
+start_mspdbsrv() {
+	local dir=$1 pid
+	(
+		. "$(dirname $0)/msvcenv.sh"
+		exe=$(host_bindir)/mspdbsrv.exe
+		[ -f "$exe" ] || exit 1
+		_MSPDBSRV_ENDPOINT_=$ENDPOINT exec $WINE "$exe" -start -shutdowntime -1
+	) &>/dev/null </dev/null 9>&- &
+	pid=$!
+	# It keeps running until stop, so if it's gone already, it failed.
+	sleep 0.5
+	if ! kill -0 $pid &>/dev/null; then
+		echo "mspdbsrv.exe failed to start for $dir" >&2
+		rm -f "$dir/mspdbsrv"
+		return 1
+	fi
+	echo $pid >"$dir/mspdbsrv"
+}
+
+stop_server() {
+	local dir=$1 pid
+	if alive "$dir"; then
+		read -r pid <"$dir/pid"
+		# The server finishes the jobs already handed to it before exiting.
+		echo quit >"$dir/jobs"
+		while kill -0 $pid &>/dev/null; do
+			sleep 0.1
+		done
+	fi
+	if [ -f "$dir/mspdbsrv" ] && read -r pid <"$dir/mspdbsrv"; then
+		kill $pid &>/dev/null
+		while kill -0 $pid &>/dev/null; do
+			sleep 0.1
+		done
+	fi
+	# Only shut down the wineserver if start was the one to start it.
+	if [ -f "$dir/wineserver" ]; then
+		"$WINESERVER" -k
+	fi
+	rm -f "$dir/jobs" "$dir/pid" "$dir/wineserver" "$dir/mspdbsrv"
+}
+
+# Makes the prefix $1 out of the current one. Only the parts that the
+# wineserver writes to are copied: the registry, which each wineserver
+# keeps in memory and saves on its own, along with the drive mappings.
+make_prefix() {
+	local template=${WINEPREFIX:-$HOME/.wine}
+	[ -f "$1/system.reg" ] && return
+	mkdir -p "$1" &&
+	cp -a "$template"/*.reg "$template/dosdevices" "$1" &&
+	cp -a "$template/.update-timestamp" "$1" 2>/dev/null
+	ln -sfn "$(cd "$template" && pwd)/drive_c" "$1/drive_c"
+}
+
+# Serializes starting and stopping the servers in $DIR, as concurrent
+# starts (like those of the cl-dist.sh workers on a host) would race in
+# making the FIFOs. Everything started in the background closes fd 9, so
+# that it doesn't hold the lock for as long as it runs.
+lock() {
+	if command -v flock >/dev/null; then
+		exec 9>"$DIR/lock" && flock 9
+	fi
+}
+
+[ $# -ge 1 ] && [ $# -le 2 ] || usage
+DIR=${2:-${WINE_MSVC_SERVER:-${TMPDIR:-/tmp}/wine-msvc-server.$(id -u)}}
+
+shards=
+[ -f "$DIR/shards" ] && read -r shards <"$DIR/shards"
+
+case $1 in
+start)
+	if [ ! -f "$MSVCTRICKS_EXE" ]; then
+		echo "$MSVCTRICKS_EXE doesn't exist" >&2
+		exit 1
+	fi
+	mkdir -p "$DIR" || exit 1
+	DIR=$(cd "$DIR" && pwd)
+	lock
+	if [ -n "$WINE_MSVC_MSPDBSRV" ]; then
+		# The same for every start in this directory, so that restarting
+		# a server that died doesn't change it for the running build.
+		ENDPOINT=wine-msvc-$(printf '%s' "$DIR" | cksum | cut -d' ' -f1)
+	fi
+	if [ -z "$shards" ] && [ "${WINE_MSVC_SERVER_SHARDS:-1}" -gt 1 ] && ! alive "$DIR"; then
+		shards=$WINE_MSVC_SERVER_SHARDS
+		echo $shards >"$DIR/shards"
+	fi
+	if [ -n "$shards" ]; then
+		for ((i = 0; i < shards; i++)); do
+			make_prefix "$DIR/$i/prefix" &&
+			WINEPREFIX="$DIR/$i/prefix" start_server "$DIR/$i" || exit 1
+		done
+	else
+		start_server "$DIR" || exit 1
+	fi
+	(
+		. "$(dirname $0)/msvcenv.sh"
+		cat "$BINDIR"/*.exe "$BINDIR"/*.dll "$(host_bindir)"/*.dll
+	) &>/dev/null </dev/null 9>&- &
+	echo "export WINE_MSVC_SERVER=$(printf '%q' "$DIR")"
+	# Only point the tools to the endpoint if there's an mspdbsrv.exe
+	# listening on it in every prefix.
+	if [ -n "$WINE_MSVC_MSPDBSRV" ]; then
+		mspdbsrv=1
+		for ((i = 0; i < ${shards:-1}; i++)); do
+			mspdbsrv_alive "$DIR${shards:+/$i}" || mspdbsrv=
+		done
+		if [ -n "$mspdbsrv" ]; then
+			echo "export _MSPDBSRV_ENDPOINT_=$ENDPOINT"
+		fi
+	fi
+	;;
+stop)
+	[ -d "$DIR" ] && lock
+	if [ -n "$shards" ]; then
+		for ((i = 0; i < shards; i++)); do
+			WINEPREFIX="$DIR/$i/prefix" stop_server "$DIR/$i" &
+		done
+		wait
+		for ((i = 0; i < shards; i++)); do
+			rm -rf "$DIR/$i/prefix"
+			rmdir "$DIR/$i" 2>/dev/null
+		done
+		rm -f "$DIR/shards"
+	else
+		stop_server "$DIR"
+	fi
+	rm -f "$DIR/lock"
+	rmdir "$DIR" 2>/dev/null
+	;;
+status)
+	running=0
+	for ((i = 0; i < ${shards:-1}; i++)); do
+		alive "$DIR${shards:+/$i}" && running=$((running+1))
+	done
+	if [ $running -eq ${shards:-1} ]; then
+		echo "running in $DIR${shards:+ ($shards shards)}"
+	else
+		echo "not running"
+		exit 1
+	fi
+	;;
+*)
+	usage
+	;;
+esac
@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Copyright (c) 2026 The msvc-wine authors
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Turns the spans appended to the WINE_MSVC_TRACE files (one JSON event per
+# line) into a Chrome trace, which chrome://tracing and ui.perfetto.dev can
+# open.
+#
+# Usage: wine-msvc-trace.sh trace... >trace.json
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 trace... >trace.json" >&2
+    exit 1
+fi
+
+echo '{"traceEvents":['
+grep -hv '^$' "$@" | sed '$!s/$/,/'
+echo '],"displayTimeUnit":"ms"}'
@@ -21,7 +21,44 @@ shift
 WINE=$(command -v wine64 || command -v wine || false)
 export WINEDEBUG=${WINEDEBUG:-"-all"}
 
+# WINE_MSVC_TRACE names a file that the wrappers and msvctricks
+# append spans of their work to, as Chrome trace events, one per line (see
+# wine-msvc-trace.sh). All spans of a wrapper invocation share its pid,
+# WINE_MSVC_TRACE_PID, as set by msvcenv.sh. The spans of the scripts need
+# the EPOCHREALTIME of bash 5.
+trace() {
+	[ -n "$WINE_MSVC_TRACE" ] && [ -n "$2" ] || return 0
+	local start=${2/[.,]/} end=${EPOCHREALTIME/[.,]/}
+	# The name, escaped for a JSON string
+	local name=${1//\\/\\\\}
+	name=${name//\"/\\\"}
+	printf '{"name":"%s","cat":"wrapper","ph":"X","ts":%s,"dur":%s,"pid":%s,"tid":%s}\n' \
+		"$name" $start $((end - start)) $WINE_MSVC_TRACE_PID $WINE_MSVC_TRACE_PID >>"$WINE_MSVC_TRACE"
+}
+
+trace_exit() {
+	trace "${EXE##*/}" "$trace_start"
+}
+
+if [ -n "$WINE_MSVC_TRACE" ]; then
+	export WINE_MSVC_TRACE_PID=${WINE_MSVC_TRACE_PID:-$$}
+	trace_start=$EPOCHREALTIME
+	trap trace_exit EXIT
+fi
+
+# Translating paths with winepath costs a wine process launch of its own. If
+# the Z: drive maps the root directory, like it does by default, the
+# translation is trivial and can be done right here instead. Paths with
+# characters that can't be part of DOS paths are left to winepath.
+if [ "${WINEPREFIX:-$HOME/.wine}/dosdevices/z:" -ef / ]; then
+	z_is_root=1
+fi
+
 ARGS=()
+CMDFILES=()
+WINEPATH_IDX=()
+WINEPATH_OPT=()
+WINEPATH_ARGS=()
 for a; do
 	path=
 	case "$a" in
@@ -50,32 +87,300 @@ for a; do
 		# tool option /h with the value ome/user/file.
 		path=$a
 		;;
-  @*)
+	@*)
 		# Remap files generated by cmake
 		# This is used to remap precompiled headers (`cmake_pch`) and command files (`@/path`)
-		$WINE "$CMAKETRICKS_EXE" "${a#?}"
+		# msvctricks does this itself before starting the tool, otherwise all
+		# of them are remapped with a single cmaketricks run below.
+		CMDFILES+=("${a#?}")
 		;;
 	*)
 		;;
 	esac
-	if [ -n "$path" ] && [ -d "$(dirname "$path")" ] && [ "$(dirname "$path")" != "/" ]; then
-		opt=${a%$path}
-		a="${opt}$(winepath -w $path)"
+	dir=${path%/}
+	dir=${dir%/*}
+	if [ -n "$dir" ] && [ -d "$dir" ]; then
+		opt=${a%"$path"}
+		case "$path" in
+		*[\\:*?\"\<\>\|]*)
+			;;
+		*)
+			if [ -n "$z_is_root" ]; then
+				a="${opt}z:${path//\//\\}"
+				path=
+			fi
+			;;
+		esac
+		if [ -n "$path" ]; then
+			WINEPATH_IDX+=(${#ARGS[@]})
+			WINEPATH_OPT+=("$opt")
+			WINEPATH_ARGS+=("$path")
+		fi
 	fi
 	ARGS+=("$a")
 done
 
+# Translate all remaining paths with a single winepath invocation.
+if [ ${#WINEPATH_ARGS[@]} -gt 0 ]; then
+	t=$EPOCHREALTIME
+	i=0
+	while IFS= read -r winpath; do
+		ARGS[${WINEPATH_IDX[$i]}]="${WINEPATH_OPT[$i]}$winpath"
+		i=$(($i+1))
+	done < <(winepath -w "${WINEPATH_ARGS[@]}")
+	trace winepath $t
+fi
+
+remap_cmdfiles() {
+	if [ ${#CMDFILES[@]} -gt 0 ]; then
+		local t=$EPOCHREALTIME
+		run_wine "$CMAKETRICKS_EXE" "${CMDFILES[@]}"
+		trace cmaketricks $t
+	fi
+}
+
+# The output filters of msvctricks, comma separated: cr, include (for
+# /showIncludes), line (#line directives of /E), diag (warnings and errors)
+# and dumpbin (/PDBPATH). When msvctricks isn't available, the corresponding
+# sed expressions are used instead. WINE_MSVC_STDOUT_SED and
+# WINE_MSVC_STDERR_SED can add further sed expressions of their own.
+filter_sed() {
+	local filter sed=
+	for filter in ${1//,/ }; do
+		case $filter in
+		cr)      sed+='s/\r//;' ;;
+		include) sed+='/^Note: including file: /{ s/z:([\\/])/\1/i; s,\\,/,g; };' ;;
+		line)    sed+='/^[[:blank:]]*#[[:blank:]]*line[[:blank:]]/{ s/z:([\\/])/\1/i; s,\\\\,/,g; };' ;;
+		diag)    sed+='/^[zZ]:.*\([[:digit:]]+\): (note|error C[[:digit:]]{4}|warning C[[:digit:]]{4}): /{ s/z:([\\/])/\1/ig; s,\\,/,g; };' ;;
+		dumpbin) sed+='/^(Dump of file |  PDB file found at )/{ s/z:([\\/])/\1/i; s,\\,/,g; };' ;;
+		esac
+	done
+	echo "$sed"
+}
+
+export WINE_MSVC_STDOUT_FILTER=cr${WINE_MSVC_STDOUT_FILTER:+,$WINE_MSVC_STDOUT_FILTER}
+export WINE_MSVC_STDERR_FILTER=cr${WINE_MSVC_STDERR_FILTER:+,$WINE_MSVC_STDERR_FILTER}
+
+# WINE_MSVC_FIXUP_LINE names a file written by the tool, typically the
+# output of cl /P, in which the #line directives are unixified (with the
+# line filter) after the tool succeeded. msvctricks does this in place,
+# otherwise sed is used.
+fixup_line() {
+	if [ -n "$WINE_MSVC_FIXUP_LINE" ] && [ -f "$WINE_MSVC_FIXUP_LINE" ]; then
+		if sed --help 2>&1 | grep '\-i extension' >/dev/null; then
+			inplace=(-i '') # BSD sed
+		else
+			inplace=(-i)    # GNU sed
+		fi
+		sed "${inplace[@]}" -E "$(filter_sed cr,line)" "$WINE_MSVC_FIXUP_LINE"
+	fi
+}
+
+# Waits for one of the WINE_MSVC_HEAVY_JOBS slots for running one of the
+# WINE_MSVC_HEAVY_TOOLS (see the limits in msvctricks), as a lock on one of
+# the slot files in a directory of our own, which holds across all prefixes
+# and server shards. msvctricks then doesn't take a slot of its own. Without
+# flock, msvctricks limits the tools per wineserver only.
+heavy=
+heavy_slot() {
+	local tool=${EXE##*/} pattern patterns matched= i t=$EPOCHREALTIME
+	local dir=${TMPDIR:-/tmp}/wine-msvc-heavy.$UID
+	[ "${WINE_MSVC_HEAVY_JOBS:-0}" -gt 0 ] && command -v flock >/dev/null || return 0
+	# Like PathMatchSpec, case insensitive.
+	IFS=';' read -r -a patterns <<<"${WINE_MSVC_HEAVY_TOOLS:-link.exe}"
+	shopt -s nocasematch
+	for pattern in "${patterns[@]}"; do
+		[[ $tool == $pattern ]] && matched=1
+	done
+	shopt -u nocasematch
+	[ -n "$matched" ] && mkdir -p "$dir" || return 0
+	while :; do
+		for ((i = 0; i < WINE_MSVC_HEAVY_JOBS; i++)); do
+			exec {heavy}>>"$dir/$i"
+			if flock -n $heavy; then
+				export WINE_MSVC_HEAVY_JOBS=0
+				trace "heavy slot" $t
+				return 0
+			fi
+			exec {heavy}>&-
+			heavy=
+		done
+		sleep 0.1
+	done
+}
+
+# The slot is held until we exit, but not by any of the processes that
+# wine starts, as these may stay around (like mspdbsrv.exe).
+run_wine() {
+	if [ -n "$heavy" ]; then
+		$WINE "$@" {heavy}>&-
+	else
+		$WINE "$@"
+	fi
+}
+
+heavy_slot
+
+# Does what msvctricks does with WINE_MSVC_DEPFILE: writes the headers of
+# the /showIncludes notes read from stdin into the depfile $1, as a rule for
+# WINE_MSVC_DEPFILE_TARGET, and leaves out the notes unless
+# WINE_MSVC_DEPFILE_NOTES is set.
+depfile_notes() {
+	awk -v deps="$1" -v target="$WINE_MSVC_DEPFILE_TARGET" -v keep="$WINE_MSVC_DEPFILE_NOTES" '
+		function escape(s) { gsub(/\$/, "$$", s); gsub(/[ #]/, "\\\\&", s); return s }
+		BEGIN { printf "%s:", escape(target) >deps }
+		/^Note: including file: / {
+			file = $0
+			sub(/^Note: including file: */, "", file)
+			if (!(file in seen)) {
+				seen[file] = 1
+				printf " \\\n  %s", escape(file) >deps
+			}
+			if (!keep)
+				next
+		}
+		{ print }
+		END { printf "\n" >deps }'
+}
+
 if [ -n "$WINE_MSVC_RAW_STDOUT" ]; then
-	$WINE "$EXE" "${ARGS[@]}"
-	exit $?
+	remap_cmdfiles
+	t=$EPOCHREALTIME
+	run_wine "$EXE" "${ARGS[@]}"
+	ec=$?
+	trace wine $t
+	[ $ec -eq 0 ] && fixup_line
+	exit $ec
+fi
+
+# Without sed expressions of its own, msvctricks can write straight to our
+# stdout and stderr, which saves two FIFOs and sed processes. That only
+# works for pipes and terminals (or e.g. /dev/null): regular files would be
+# opened anew there, at an offset of their own, and sockets can't be opened
+# at all, so they still go through a FIFO.
+direct_fd() {
+	[ -p /proc/$$/fd/$1 ] || [ -c /proc/$$/fd/$1 ]
+}
+
+direct_output() {
+	[ -z "$WINE_MSVC_STDOUT_SED$WINE_MSVC_STDERR_SED" ] && direct_fd 1 && direct_fd 2
+}
+
+# With several server shards (see wine-msvc-server.sh), pick the one with
+# the fewest jobs running, going by the status FIFOs of the jobs in its
+# directory.
+server=$WINE_MSVC_SERVER
+if [ -n "$server" ] && [ -f "$server/shards" ] && read -r shards <"$server/shards"; then
+	shopt -s nullglob
+	least=
+	for ((i = $$ % shards, n = 0; n < shards; i = (i + 1) % shards, n++)); do
+		running=("$WINE_MSVC_SERVER/$i"/job.*.status)
+		if [ -z "$least" ] || [ ${#running[@]} -lt $least ]; then
+			server=$WINE_MSVC_SERVER/$i
+			least=${#running[@]}
+		fi
+	done
+	shopt -u nullglob
 fi
 
-WINE_MSVC_STDOUT_SED='s/\r//;'"$WINE_MSVC_STDOUT_SED"
-WINE_MSVC_STDERR_SED='s/\r//;'"$WINE_MSVC_STDERR_SED"
+if [ -n "$server" ] && [ -p "$server/jobs" ] &&
+   read -r server_pid <"$server/pid" && kill -0 $server_pid &>/dev/null; then
+	# Hand the job over to a running msvctricks server (see
+	# wine-msvc-server.sh), which starts the tool from an already
+	# running wine process.
+	job=$server/job.$$
+	seds=()
+
+	cleanup() {
+		wait
+		rm -f "$job" "$job.stdout" "$job.stderr" "$job.status"
+	}
+
+	trap 'cleanup; trace_exit' EXIT
+
+	if direct_output; then
+		stdout=/proc/$$/fd/1
+		stderr=/proc/$$/fd/2
+		cleanup && mkfifo "$job.status" || exit 1
+	else
+		stdout=$job.stdout
+		stderr=$job.stderr
+		cleanup && mkfifo "$job.stdout" "$job.stderr" "$job.status" || exit 1
+		sed -E 's/\r//;'"$WINE_MSVC_STDOUT_SED" <"$job.stdout" &
+		seds+=($!)
+		sed -E 's/\r//;'"$WINE_MSVC_STDERR_SED" <"$job.stderr" >&2 &
+		seds+=($!)
+	fi
+	# Keep the status FIFO open for reading from the start, so that
+	# neither side blocks in opening it.
+	exec {status}<>"$job.status"
+
+	# The server runs with its own environment; pass along the parts of
+	# ours that matter to the tools.
+	env=()
+	for var in INCLUDE LIB LIBPATH CL _CL_ LINK _LINK_ ML _ML_ WINEPATH WINEDLLOVERRIDES _MSPDBSRV_ENDPOINT_ ${!WINE_MSVC_*}; do
+		[ -n "${!var+set}" ] && env+=("$var=${!var}")
+	done
+	printf '%s\0' "$PWD" "$stdout" "$stderr" "$job.status" "${env[@]}" "" "$EXE" "${ARGS[@]}" >"$job"
+	t=$EPOCHREALTIME
+	# Opening the FIFO for reading as well never blocks, even if the
+	# server is gone by now.
+	echo "$job" 1<>"$server/jobs"
+
+	# Don't wait forever for a server that died or was stopped. The
+	# server removes the job file once it has read it; if it never got
+	# that far, the tool hasn't run, and runs here instead.
+	while ! read -r -t 1 ec <&$status; do
+		kill -0 $server_pid &>/dev/null && continue
+		read -r -t 0.1 ec <&$status && break
+		# The seds may still be waiting for the server to open the FIFOs.
+		kill ${seds[@]} &>/dev/null
+		if [ -f "$job" ]; then
+			ec=
+			break
+		fi
+		echo "$0: the server in $server exited while running $EXE" >&2
+		exit 1
+	done
+	if [ -n "$ec" ]; then
+		trace server $t
+		exit $ec
+	fi
+	exec {status}<&-
+	cleanup
+	trap trace_exit EXIT
+fi
 
 if [ ! -f "$MSVCTRICKS_EXE" ]; then
-	$WINE "$EXE" "${ARGS[@]}" 2> >(sed -E "$WINE_MSVC_STDERR_SED" >&2) | sed -E "$WINE_MSVC_STDOUT_SED"
-	exit $PIPESTATUS
+	remap_cmdfiles
+	WINE_MSVC_STDOUT_SED="$(filter_sed $WINE_MSVC_STDOUT_FILTER)$WINE_MSVC_STDOUT_SED"
+	WINE_MSVC_STDERR_SED="$(filter_sed $WINE_MSVC_STDERR_FILTER)$WINE_MSVC_STDERR_SED"
+	t=$EPOCHREALTIME
+	if [ -n "$WINE_MSVC_DEPFILE" ]; then
+		deps=$WINE_MSVC_DEPFILE.tmp.$$
+		run_wine "$EXE" "${ARGS[@]}" 2> >(sed -E "$WINE_MSVC_STDERR_SED" >&2) | sed -E "$WINE_MSVC_STDOUT_SED" |
+			depfile_notes "$deps"
+	else
+		run_wine "$EXE" "${ARGS[@]}" 2> >(sed -E "$WINE_MSVC_STDERR_SED" >&2) | sed -E "$WINE_MSVC_STDOUT_SED"
+	fi
+	ec=$PIPESTATUS
+	trace wine $t
+	[ $ec -eq 0 ] && fixup_line
+	if [ -n "$WINE_MSVC_DEPFILE" ]; then
+		if [ $ec -eq 0 ]; then
+			mv -f "$deps" "$WINE_MSVC_DEPFILE"
+		else
+			rm -f "$deps"
+		fi
+	fi
+	exit $ec
+elif direct_output; then
+	t=$EPOCHREALTIME
+	WINE_MSVC_STDOUT=/proc/$$/fd/1 WINE_MSVC_STDERR=/proc/$$/fd/2 \
+		run_wine "$MSVCTRICKS_EXE" "$EXE" "${ARGS[@]}" >/dev/null
+	ec=$?
+	trace wine $t
+	exit $ec
 else
 	export WINE_MSVC_STDOUT=${TMPDIR:-/tmp}/wine-msvc.stdout.$$
 	export WINE_MSVC_STDERR=${TMPDIR:-/tmp}/wine-msvc.stderr.$$
@@ -85,13 +390,24 @@ else
 		rm -f $WINE_MSVC_STDOUT $WINE_MSVC_STDERR
 	}
 
-	trap cleanup EXIT
+	trap 'cleanup; trace_exit' EXIT
 
 	cleanup && mkfifo $WINE_MSVC_STDOUT $WINE_MSVC_STDERR || exit 1
 
-	$WINE "$MSVCTRICKS_EXE" "$EXE" "${ARGS[@]}" &>/dev/null &
+	t=$EPOCHREALTIME
+	run_wine "$MSVCTRICKS_EXE" "$EXE" "${ARGS[@]}" >/dev/null &
 	pid=$!
-	sed -E "$WINE_MSVC_STDOUT_SED" <$WINE_MSVC_STDOUT     || kill $pid &>/dev/null &
-	sed -E "$WINE_MSVC_STDERR_SED" <$WINE_MSVC_STDERR >&2 || kill $pid &>/dev/null &
+	sed -E 's/\r//;'"$WINE_MSVC_STDOUT_SED" <$WINE_MSVC_STDOUT     || kill $pid &>/dev/null &
+	sed -E 's/\r//;'"$WINE_MSVC_STDERR_SED" <$WINE_MSVC_STDERR >&2 || kill $pid &>/dev/null &
 	wait $pid &>/dev/null
+	ec=$?
+	trace wine $t
+	# If msvctricks failed before opening the FIFOs, the seds would wait
+	# for that forever.
+	: 1<>$WINE_MSVC_STDOUT 2<>$WINE_MSVC_STDERR
+	# The sed processes finish up with what the tool wrote last.
+	t=$EPOCHREALTIME
+	wait
+	trace sed $t
+	exit $ec
 fi